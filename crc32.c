@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "fastboot.h"
+
+/*
+ * CRC32 of the data phases, the zlib polynomial, on the CPU's carry-less
+ * multiply (x86 PCLMULQDQ) or CRC32 instructions (ARMv8) where it has
+ * them, with zlib's table-driven code as the fallback. The hashing runs
+ * on the thread feeding the link, so it is kept well below link speed.
+ * The unit is picked once, at run time.
+ */
+
+typedef uint32_t (*crc_func)(uint32_t crc, const unsigned char *p,
+                             unsigned len);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/*
+ * Folds 64 bytes at a time with carry-less multiplies and Barrett reduces
+ * the result, as in Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction", with the bit-reflected constants given at
+ * its end. Works on the uninverted CRC; @len is at least 64 and a multiple
+ * of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_pclmul(uint32_t crc, const unsigned char *p, unsigned len)
+{
+    static const uint64_t __attribute__((aligned(16)))
+        k1k2[] = { 0x0154442bd4ULL, 0x01c6e41596ULL },
+        k3k4[] = { 0x01751997d0ULL, 0x00ccaa009eULL },
+        k5k0[] = { 0x0163cd6124ULL, 0x0000000000ULL },
+        poly[] = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    p += 64;
+    len -= 64;
+
+    /* four lanes of 16 bytes, each folded 64 bytes ahead */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*) (p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i*) (p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i*) (p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i*) (p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    /* the lanes into one */
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 */
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_x86(uint32_t crc, const unsigned char *p, unsigned len)
+{
+    unsigned n;
+
+    if (len >= 64) {
+        n = len & ~15U;
+        crc = ~crc_pclmul(~crc, p, n);
+        p += n;
+        len -= n;
+    }
+    return len ? crc32(crc, p, len) : crc;
+}
+
+static crc_func pick(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return crc_x86;
+    return 0;
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+/* the CRC32 instructions use the zlib polynomial (CRC32C is another) */
+__attribute__((target("+crc")))
+static uint32_t crc_armv8(uint32_t crc, const unsigned char *p,
+                          unsigned len)
+{
+    uint64_t v;
+
+    crc = ~crc;
+    while (len && ((uintptr_t) p & 7)) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        __builtin_memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+static crc_func pick(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) ? crc_armv8 : 0;
+}
+
+#else
+
+static crc_func pick(void)
+{
+    return 0;
+}
+
+#endif
+
+static crc_func unit;
+static pthread_once_t unit_once = PTHREAD_ONCE_INIT;
+
+static void pick_unit(void)
+{
+    unit = pick();
+}
+
+unsigned long fb_crc32(unsigned long crc, const void *buf, unsigned len)
+{
+    pthread_once(&unit_once, pick_unit);
+    if (unit == 0)
+        return crc32(crc, buf, len);
+    return unit(crc, buf, len);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fastboot.h"
+
+/*
+ * Where each device was plugged in last time, "serial<TAB>port" per line
+ * with the most recent first. A device keeps its port across a reboot, so
+ * that one port is looked at first instead of every bus.
+ */
+
+#define DEVCACHE_FILE    ".prekit_devices"
+#define DEVCACHE_ENTRIES 64
+#define DEVCACHE_LINE    (256 + 64 + 2)
+
+static int cache_path(char *path, int size)
+{
+    const char *home = getenv("HOME");
+
+    if (home == 0 || home[0] == 0)
+        return -1;
+    snprintf(path, size, "%s/%s", home, DEVCACHE_FILE);
+    return 0;
+}
+
+/* split a line into its serial and port, -1 if it isn't one */
+static int parse_line(char *line, char **port)
+{
+    char *p;
+
+    line[strcspn(line, "\n")] = 0;
+    p = strchr(line, '\t');
+    if (p == 0 || p == line || p[1] == 0)
+        return -1;
+    *p = 0;
+    *port = p + 1;
+    return 0;
+}
+
+int devcache_lookup(const char *serial, char *port, int size)
+{
+    char path[1024], line[DEVCACHE_LINE];
+    char *p;
+    FILE *f;
+    int r = -1;
+
+    if (serial == 0 || serial[0] == 0 || cache_path(path, sizeof(path)))
+        return -1;
+    f = fopen(path, "r");
+    if (f == 0)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (parse_line(line, &p) || strcmp(line, serial))
+            continue;
+        snprintf(port, size, "%s", p);
+        r = 0;
+        break;
+    }
+    fclose(f);
+    return r;
+}
+
+void devcache_store(const char *serial, const char *port)
+{
+    char path[1024], tmp[1040], line[DEVCACHE_LINE];
+    char *p;
+    FILE *in, *out;
+    int n = 1;
+
+    if (serial == 0 || serial[0] == 0 || port == 0 || port[0] == 0 ||
+        strchr(serial, '\t') || strchr(serial, '\n') ||
+        cache_path(path, sizeof(path)))
+        return;
+
+    in = fopen(path, "r");
+    /* nothing to do if this is already the latest entry */
+    if (in && fgets(line, sizeof(line), in) && !parse_line(line, &p) &&
+        !strcmp(line, serial) && !strcmp(p, port)) {
+        fclose(in);
+        return;
+    }
+    if (in)
+        rewind(in);
+
+    /* written aside and renamed, parallel runs never see half a file */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    out = fopen(tmp, "w");
+    if (out == 0) {
+        if (in) fclose(in);
+        return;
+    }
+
+    fprintf(out, "%s\t%s\n", serial, port);
+    while (in && n < DEVCACHE_ENTRIES && fgets(line, sizeof(line), in)) {
+        if (parse_line(line, &p) || !strcmp(line, serial))
+            continue;
+        fprintf(out, "%s\t%s\n", line, p);
+        n++;
+    }
+    if (in)
+        fclose(in);
+
+    if (fclose(out) || rename(tmp, path))
+        unlink(tmp);
+}
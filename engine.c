@@ -30,9 +30,16 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#endif
 
 #include "fastboot.h"
 
@@ -65,6 +72,49 @@ char *mkmsg(const char *fmt, ...)
 #define OP_FLASH      5
 
 typedef struct Action Action;
+typedef struct Run Run;
+typedef struct VarCache VarCache;
+
+/* one pass of the action queue over one device, several runs may share
+ * the queue (and the image data it points to) from different threads.
+ */
+struct Run
+{
+    fb_session s;       /* the device's transport, error and INFO output */
+    const char *tag;    /* device name prefixed to output, 0 if alone */
+
+    double start;       /* start of the current action */
+    double elapsed;
+    int status;
+    int retries;        /* data phases sent again after a link failure */
+    char error[128];
+
+    /* the device's max-download-size, asked once; 0 until then */
+    unsigned max_download;
+    /* device takes data phases in segments: 1 yes, -1 no, 0 not asked */
+    int segments;
+    VarCache *vars;
+};
+
+#define VAR_CACHE_SIZE 128
+
+/* Variables of one device, kept across executions of the queue. Filled by
+ * one getvar:all, or one getvar at a time where the device has no "all";
+ * anything that may change the device's state empties it.
+ */
+struct VarCache
+{
+    transport *t;
+    VarCache *next;
+
+    int filled;         /* getvar:all went through since the last change */
+    int no_all;         /* the device doesn't know getvar:all */
+    int count;
+    struct {
+        char name[FB_COMMAND_SZ];
+        char value[FB_RESPONSE_SZ + 1];
+    } var[VAR_CACHE_SIZE];
+};
 
 struct Action 
 {
@@ -74,30 +124,80 @@ struct Action
     char cmd[64];    
     const char *prod;
     void *data;
-    unsigned size;
+    unsigned long long size;
 
-    const char *msg;
-    int (*func)(Action *a, int status, char *resp);
+    /* OP_FLASH: partition, for the commands of a segmented flash */
+    char *ptn;
 
-    double start;
+    /* OP_FLASH without data: payload is produced by fill, rewind (if
+     * any) starts it over for a retry, release (if any) frees the cookie
+     * once the action is dropped */
+    transport_fill_func fill;
+    int (*rewind)(void *cookie);
+    void (*release)(void *cookie);
+    void *cookie;
+
+    /* OP_FLASH from an image, read by each run on its own */
+    image *img;
+
+    const char *msg;
+    int (*func)(Action *a, Run *r, int status, char *resp);
 };
 
 static Action *action_list = 0;
 static Action *action_last = 0;
 
-static int cb_default(Action *a, int status, char *resp)
+/* prefix of the command that asks for a partition's CRC32, 0 if none */
+static const char *checksum_query = 0;
+
+/* set once fb_execute_queue_all was interrupted, no more retries then */
+static volatile int cancelled = 0;
+
+/* whole lines only, so output of parallel runs doesn't interleave */
+static void run_printf(Run *r, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (r->tag)
+        fprintf(stderr, "[%s] %s", r->tag, buf);
+    else
+        fputs(buf, stderr);
+}
+
+static int cb_default(Action *a, Run *r, int status, char *resp)
 {
     if (status) {
-        fprintf(stderr,"FAILED (%s)\n", resp);
+        run_printf(r, "FAILED (%s)\n", resp);
     } else {
         double split = now();
-        fprintf(stderr,"OKAY [%7.3fs]\n", (split - a->start) < 0 ? 0 :
-				(split - a->start));
-        a->start = split;
+        run_printf(r, "OKAY [%7.3fs]\n", (split - r->start) < 0 ? 0 :
+				(split - r->start));
+        r->start = split;
     }
     return status;
 }
 
+/* a data phase went out, tell what was sent */
+static int cb_data(Action *a, Run *r, int status, char *resp)
+{
+    double split;
+
+    if (status)
+        return cb_default(a, r, status, resp);
+
+    split = now();
+    run_printf(r, "OKAY [%7.3fs] crc32 %08lx%s\n",
+               (split - r->start) < 0 ? 0 : (split - r->start), r->s.crc,
+               a->op == OP_FLASH && checksum_query ? ", matches device" : "");
+    r->start = split;
+    return status;
+}
+
 static Action *queue_action(unsigned op, const char *fmt, ...)
 {
     Action *a;
@@ -123,9 +223,7 @@ static Action *queue_action(unsigned op, const char *fmt, ...)
     }
     action_last = a;
     a->op = op;
-    a->func = cb_default;
-
-    a->start = -1;
+    a->func = op == OP_DOWNLOAD || op == OP_FLASH ? cb_data : cb_default;
 
     return a;
 }
@@ -157,6 +255,7 @@ void fb_queue_stream_flash(const char *ptn, void *data, unsigned sz)
 {
     Action *a;
     a = queue_action(OP_FLASH, "flash:%s:%08X", ptn, sz);
+    a->ptn = mkmsg("%s", ptn);
     a->data = data;
     a->size = sz;
     if (ptn && strlen(ptn) > 0)
@@ -165,6 +264,21 @@ void fb_queue_stream_flash(const char *ptn, void *data, unsigned sz)
         a->msg = mkmsg("");
 }
 
+void fb_queue_stream_flash_fill(const char *ptn, transport_fill_func fill,
+        int (*rewind)(void *cookie), void (*release)(void *cookie),
+        void *cookie, unsigned sz)
+{
+    Action *a;
+    a = queue_action(OP_FLASH, "flash:%s:%08X", ptn, sz);
+    a->ptn = mkmsg("%s", ptn);
+    a->fill = fill;
+    a->rewind = rewind;
+    a->release = release;
+    a->cookie = cookie;
+    a->size = sz;
+    a->msg = mkmsg("streaming flash '%s', size (%d KB)", ptn, sz / 1024);
+}
+
 static int match(char *str, const char **value, unsigned count)
 {
     const char *val;
@@ -189,14 +303,14 @@ static int match(char *str, const char **value, unsigned count)
     return 0;
 }
 
-static int cb_display(Action *a, int status, char *resp)
+static int cb_display(Action *a, Run *r, int status, char *resp)
 {
     if (status) {
-        fprintf(stderr, "%s FAILED (%s)\n", a->cmd, resp);
+        run_printf(r, "%s FAILED (%s)\n", a->cmd, resp);
         return status;
     }
     if (strlen(a->data) > 0)
-        fprintf(stderr, "%s: %s\n", (char*) a->data, resp);
+        run_printf(r, "%s: %s\n", (char*) a->data, resp);
     return 0;
 }
 
@@ -209,10 +323,10 @@ void fb_queue_display(const char *var, const char *prettyname)
     a->func = cb_display;
 }
 
-static int cb_save(Action *a, int status, char *resp)
+static int cb_save(Action *a, Run *r, int status, char *resp)
 {
     if (status) {
-        fprintf(stderr, "%s FAILED (%s)\n", a->cmd, resp);
+        run_printf(r, "%s FAILED (%s)\n", a->cmd, resp);
         return status;
     }
     strncpy(a->data, resp, a->size);
@@ -248,54 +362,600 @@ void fb_queue_notice(const char *notice)
     a->data = (void*) notice;
 }
 
-int fb_execute_queue(usb_handle *usb)
+void fb_queue_stream_flash_image(const char *ptn, image *img)
+{
+    Action *a;
+    /* over 4GB only segments fit in the command, see send_segments */
+    a = queue_action(OP_FLASH, "flash:%s:%08llX", ptn, image_size(img));
+    a->ptn = mkmsg("%s", ptn);
+    a->img = img;
+    a->size = image_size(img);
+    a->msg = mkmsg("streaming flash '%s', size (%llu KB)", ptn, a->size / 1024);
+}
+
+void fb_set_checksum_query(const char *query)
+{
+    checksum_query = query;
+}
+
+/* one cache per device, only created before runs start */
+static VarCache *var_caches = 0;
+
+static VarCache *var_cache(transport *t)
+{
+    VarCache *c;
+
+    for (c = var_caches; c; c = c->next)
+        if (c->t == t)
+            return c;
+
+    c = calloc(1, sizeof(VarCache));
+    if (c == 0) die("out of memory");
+    c->t = t;
+    c->next = var_caches;
+    var_caches = c;
+    return c;
+}
+
+static void var_store(VarCache *c, const char *name, const char *value)
+{
+    int i;
+
+    for (i = 0; i < c->count; i++)
+        if (!strcmp(c->var[i].name, name))
+            break;
+    if (i == VAR_CACHE_SIZE)
+        return;
+    if (i == c->count)
+        c->count++;
+    snprintf(c->var[i].name, sizeof(c->var[i].name), "%s", name);
+    snprintf(c->var[i].value, sizeof(c->var[i].value), "%s", value);
+}
+
+static int var_lookup(VarCache *c, const char *name, char *value)
+{
+    int i;
+
+    for (i = 0; i < c->count; i++) {
+        if (!strcmp(c->var[i].name, name)) {
+            strcpy(value, c->var[i].value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void var_forget(VarCache *c)
+{
+    c->filled = 0;
+    c->count = 0;
+}
+
+/* a "name: value" line of getvar:all; the name may hold ':' itself, as
+ * in "partition-size:system: 0x1000" */
+static void var_info(void *cookie, const char *info)
+{
+    char line[FB_RESPONSE_SZ + 1];
+    char *value, *p;
+
+    snprintf(line, sizeof(line), "%s", info);
+    line[strcspn(line, "\r\n")] = 0;
+    value = 0;
+    for (p = strstr(line, ": "); p; p = strstr(p + 1, ": "))
+        value = p;
+    if (value == 0 || value == line)
+        return;
+    *value = 0;
+    value += 2;
+    var_store(cookie, line, value);
+}
+
+/* INFO lines of a run; with several devices at once each gets a line of
+ * its own, tagged like the rest of the run's output */
+static void run_info(void *cookie, const char *info)
+{
+    Run *r = cookie;
+
+    if (r->tag)
+        printf("[%s] %.*s\n", r->tag, (int) strcspn(info, "\r\n"), info);
+    else
+        printf("%s", info);
+}
+
+/* getvar:<name>, answered from the cache where possible */
+static int query_var(Run *r, const char *cmd, char *resp)
+{
+    VarCache *c = r->vars;
+    const char *name = cmd + strlen("getvar:");
+    int status;
+
+    /* the listing itself, ask the device */
+    if (name[0] == 0 || !strcmp(name, "all"))
+        return fb_session_command(&r->s, cmd, resp);
+
+    if (!c->filled && !c->no_all) {
+        /* the listing comes as INFO lines, for the cache not the user */
+        r->s.info = var_info;
+        r->s.info_cookie = c;
+        status = fb_session_command(&r->s, "getvar:all", resp);
+        r->s.info = run_info;
+        r->s.info_cookie = r;
+
+        if (status == 0) {
+            c->filled = 1;
+        } else if (r->s.link_failed) {
+            return -1;
+        } else {
+            /* answered one by one from now on */
+            c->no_all = 1;
+        }
+    }
+
+    if (var_lookup(c, name, resp) == 0)
+        return 0;
+
+    /* not in the listing (or no listing), ask for it alone */
+    if (fb_session_command(&r->s, cmd, resp))
+        return -1;
+    var_store(c, name, resp);
+    return 0;
+}
+
+/* attempts of one data phase when the link fails under it */
+#define DATA_TRIES 3
+
+/* The device's max-download-size, asked on first use. A device that
+ * doesn't say takes any size.
+ */
+static unsigned max_download(Run *r)
+{
+    char resp[FB_RESPONSE_SZ + 1];
+    unsigned long val;
+
+    if (r->max_download == 0) {
+        r->max_download = UINT_MAX;
+        if (query_var(r, "getvar:max-download-size", resp) == 0) {
+            val = strtoul(resp, 0, 0);
+            if (val > 0 && val < UINT_MAX)
+                r->max_download = val;
+        }
+    }
+    return r->max_download;
+}
+
+/* Whether the device takes a data phase over max-download-size as
+ * "<cmd>:<size>:<offset>" segments, which it says with getvar:segments.
+ */
+static int takes_segments(Run *r)
+{
+    char resp[FB_RESPONSE_SZ + 1];
+
+    if (r->segments == 0) {
+        if (query_var(r, "getvar:segments", resp) == 0 && !strcmp(resp, "yes"))
+            r->segments = 1;
+        else
+            r->segments = -1;
+    }
+    return r->segments > 0;
+}
+
+/* where a payload comes from, filled into the transport's buffers or
+ * lent out of a ring */
+struct payload
+{
+    transport_fill_func fill;
+    void *cookie;
+    transport_source ring;
+};
+
+/* flash the next @size bytes of @src with @cmd */
+static int send_payload(Run *r, const char *cmd, struct payload *src,
+                        unsigned size)
+{
+    if (src->ring.next)
+        return fb_session_stream_flash_next(&r->s, cmd, &src->ring, size);
+    return fb_session_stream_flash_fill(&r->s, cmd, src->fill, src->cookie,
+                                        size);
+}
+
+/*
+ * A payload larger than the device takes in one go is flashed as a run of
+ * "flash:<ptn>:<size>:<offset>" segments, each written by the device
+ * before the next one is sent. The source is read through once, so while
+ * the device commits a segment the producer is already filling the ring
+ * with the next.
+ */
+static int send_segments(Action *a, Run *r, struct payload *src,
+                         unsigned max)
+{
+    unsigned long long offset;
+    char cmd[FB_COMMAND_SZ + 1];
+    unsigned seg;
+
+    for (offset = 0; offset < a->size; offset += seg) {
+        seg = a->size - offset > max ? max : a->size - offset;
+        snprintf(cmd, sizeof(cmd), "flash:%s:%08X:%llX", a->ptn, seg, offset);
+        if (send_payload(r, cmd, src, seg))
+            return -1;
+    }
+    return 0;
+}
+
+/* Reading and inflating a large payload runs on a thread of its own, a
+ * few chunks ahead of the transfer, so neither the bus nor the CPU waits
+ * for the other. The chunks are sent from where they were produced.
+ */
+static int send_fill(Action *a, Run *r, transport_fill_func fill,
+                     void *cookie)
+{
+    struct payload src;
+    chunk_ring *ring = 0;
+    unsigned max = max_download(r);
+    int status;
+
+    memset(&src, 0, sizeof(src));
+    src.fill = fill;
+    src.cookie = cookie;
+    if (a->size >= RING_MIN_SIZE) {
+        ring = ring_start(r->s.t, fill, cookie, a->size);
+        if (ring) {
+            src.ring.next = ring_next;
+            src.ring.release = ring_release;
+            src.ring.cookie = ring;
+        }
+    }
+
+    /* without segments it goes in one phase, a device with no limit
+     * of its own streams it */
+    if (a->size > max && takes_segments(r)) {
+        status = send_segments(a, r, &src, max);
+    } else if (a->size > UINT_MAX) {
+        strcpy(r->s.error, "image over 4GB, device takes no segments");
+        status = -1;
+    } else {
+        status = send_payload(r, a->cmd, &src, a->size);
+    }
+
+    if (ring)
+        ring_finish(ring);
+    return status;
+}
+
+/* A download over max-download-size goes as "download:<size>:<offset>"
+ * parts, appended by the device, where it takes segments.
+ */
+static int send_download(Action *a, Run *r)
+{
+    unsigned max = max_download(r);
+    unsigned offset, part;
+
+    if (a->size <= max || !takes_segments(r))
+        return fb_session_download(&r->s, a->data, a->size);
+
+    for (offset = 0; offset < a->size; offset += part) {
+        part = a->size - offset > max ? max : a->size - offset;
+        if (fb_session_download_part(&r->s, (char*) a->data + offset, part,
+                                     offset))
+            return -1;
+    }
+    return 0;
+}
+
+static int send_data(Action *a, Run *r)
+{
+    image_reader rd;
+
+    if (a->op == OP_DOWNLOAD)
+        return send_download(a, r);
+
+    if (a->img) {
+        rd.img = a->img;
+        rd.offset = 0;
+        return send_fill(a, r, image_fill, &rd);
+    } else if (a->fill) {
+        return send_fill(a, r, a->fill, a->cookie);
+    }
+    return fb_session_stream_flash(&r->s, a->cmd, a->data, a->size);
+}
+
+/* the data has to be produced once more for a retry */
+static int rewind_data(Action *a)
+{
+    if (a->img)
+        return image_rewind(a->img);
+    if (a->fill)
+        return a->rewind ? a->rewind(a->cookie) : -1;
+    return 0;
+}
+
+/*
+ * Send a download or streaming flash. If the link broke (not if the device
+ * said FAIL) it is recovered, first by clearing halts and then by a reset,
+ * and just this partition is sent again.
+ */
+static int run_data(Action *a, Run *r)
+{
+    int status, tries;
+
+    for (tries = 1; ; tries++) {
+        r->s.crc = 0;
+        status = send_data(a, r);
+        if (status == 0 || !r->s.link_failed || cancelled ||
+            tries >= DATA_TRIES)
+            return status;
+
+        if (rewind_data(a)) {
+            run_printf(r, "%s, cannot send the data again\n", r->s.error);
+            return status;
+        }
+        /* a device left inside a data phase only gets out by a reset */
+        if (transport_recover(r->s.t, r->s.in_data || tries > 1)) {
+            run_printf(r, "%s, link recovery failed (%s)\n", r->s.error,
+                       strerror(errno));
+            return status;
+        }
+        run_printf(r, "%s, retrying\n", r->s.error);
+        r->retries++;
+    }
+}
+
+/* ask the device for the CRC32 of the partition just flashed */
+static int check_flash(Action *a, Run *r)
+{
+    char cmd[FB_COMMAND_SZ + 1];
+    char resp[FB_RESPONSE_SZ + 1];
+    unsigned long crc;
+    char *end;
+
+    if (snprintf(cmd, sizeof(cmd), "%s%s", checksum_query, a->ptn) >
+        FB_COMMAND_SZ) {
+        strcpy(r->s.error, "checksum query too long");
+        return -1;
+    }
+    if (fb_session_command(&r->s, cmd, resp))
+        return -1;
+
+    crc = strtoul(resp, &end, 16);
+    if (end == resp) {
+        snprintf(r->s.error, sizeof(r->s.error),
+                 "no crc32 in the reply '%s'", resp);
+        return -1;
+    }
+    if (crc != r->s.crc) {
+        snprintf(r->s.error, sizeof(r->s.error),
+                 "crc32 mismatch, sent %08lx, device has %08lx", r->s.crc, crc);
+        return -1;
+    }
+    return 0;
+}
+
+static void run_init(Run *r, transport *t, const char *tag)
+{
+    fb_session_init(&r->s, t);
+    r->s.info = run_info;
+    r->s.info_cookie = r;
+    r->s.pull_fd = fd_pull;
+    r->s.hash = 1;
+    r->tag = tag;
+    r->vars = var_cache(t);
+}
+
+static int run_queue(Run *r)
 {
     Action *a;
     char resp[FB_RESPONSE_SZ+1];
     int status = 0;
+    double start;
 
-    a = action_list;
     resp[FB_RESPONSE_SZ] = 0;
 
-    double start = -1;
+    start = now();
     for (a = action_list; a; a = a->next) {
-        a->start = now();
-        if (start < 0) start = a->start;
+        r->start = now();
         if (a->msg) {
             // fprintf(stderr,"%30s... ",a->msg);
-            fprintf(stderr,"%s...\n",a->msg);
+            run_printf(r, "%s...\n", a->msg);
         }
         if (a->op == OP_DOWNLOAD) {
-            status = fb_download_data(usb, a->data, a->size);
-            status = a->func(a, status, status ? fb_get_error() : "");
+            status = run_data(a, r);
+            status = a->func(a, r, status, status ? r->s.error : "");
             if (status) break;
         } else if (a->op == OP_COMMAND) {
-            status = fb_command(usb, a->cmd);
-            status = a->func(a, status, status ? fb_get_error() : "");
-            if (status) {
-                if (strlen(fn_pull) > 0)
-                    unlink(fn_pull);
-                if (fd_pull > 0)
-                    close(fd_pull);
-                break;
+            var_forget(r->vars);
+            status = fb_session_command(&r->s, a->cmd, 0);
+            status = a->func(a, r, status, status ? r->s.error : "");
+            if (status && strlen(fn_pull) > 0)
+                unlink(fn_pull);
+            if (fd_pull >= 0) {
+                close(fd_pull);
+                fd_pull = -1;
+                r->s.pull_fd = -1;
             }
-            close(fd_pull);
+            if (status) break;
         } else if (a->op == OP_QUERY) {
-            status = fb_command_response(usb, a->cmd, resp);
-            status = a->func(a, status, status ? fb_get_error() : resp);
+            status = query_var(r, a->cmd, resp);
+            status = a->func(a, r, status, status ? r->s.error : resp);
             if (status) break;
         } else if (a->op == OP_NOTICE) {
-            fprintf(stderr,"%s\n",(char*)a->data);
+            run_printf(r, "%s\n", (char*)a->data);
         } else if (a->op == OP_FLASH) {
-            status = fb_stream_flash(usb, a->cmd, a->data, a->size);
-            status = a->func(a, status, status ? fb_get_error() : "");
+            var_forget(r->vars);
+            status = run_data(a, r);
+            if (status == 0 && checksum_query)
+                status = check_flash(a, r);
+            status = a->func(a, r, status, status ? r->s.error : "");
             if (status) break;
         } else {
             die("bogus action");
         }
     }
 
-    double split = now() - start;
-    fprintf(stderr,"finished. total time: %.3fs\n", split < 0 ? 0 : split);
+    r->elapsed = now() - start;
+    if (r->elapsed < 0) r->elapsed = 0;
+    r->status = status;
+    if (status)
+        snprintf(r->error, sizeof(r->error), "%s", r->s.error);
     return status;
 }
+
+/* actions run once, a later execution only sees what was queued since */
+static void drop_queue(void)
+{
+    Action *a, *next;
+
+    for (a = action_list; a; a = next) {
+        next = a->next;
+        image_free(a->img);
+        if (a->release)
+            a->release(a->cookie);
+        free(a->ptn);
+        free(a);
+    }
+    action_list = 0;
+    action_last = 0;
+}
+
+int fb_execute_queue(transport *t)
+{
+    Run r;
+
+    memset(&r, 0, sizeof(r));
+    run_init(&r, t, 0);
+    run_queue(&r);
+    drop_queue();
+
+    if (r.retries)
+        fprintf(stderr, "%d data phase(s) sent again after link errors\n",
+                r.retries);
+    fprintf(stderr,"finished. total time: %.3fs\n", r.elapsed);
+    return r.status;
+}
+
+static void *run_thread(void *arg)
+{
+    run_queue(arg);
+    return 0;
+}
+
+/*
+ * While fb_execute_queue_all runs, an interrupt (SIGINT/SIGTERM, Ctrl-C
+ * on Windows) cancels every link. Workers stuck in a transfer then fail
+ * with ECANCELED and the summary is still printed.
+ */
+static transport **watched;
+static int watched_count;
+
+static void cancel_all(void)
+{
+    int i;
+
+    if (!cancelled)
+        fprintf(stderr, "interrupted, cancelling all devices\n");
+    cancelled = 1;
+    for (i = 0; i < watched_count; i++)
+        transport_cancel(watched[i]);
+}
+
+#ifdef _WIN32
+/* runs on a thread of its own, like the watcher below */
+static BOOL WINAPI console_ctrl(DWORD type)
+{
+    if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT &&
+        type != CTRL_CLOSE_EVENT)
+        return FALSE;
+    cancel_all();
+    return TRUE;
+}
+
+static void watch_start(void)
+{
+    SetConsoleCtrlHandler(console_ctrl, TRUE);
+}
+
+static void watch_stop(void)
+{
+    SetConsoleCtrlHandler(console_ctrl, FALSE);
+}
+#else
+static pthread_t watcher;
+static sigset_t watch_signals, watch_saved;
+
+static void *watch_thread(void *arg)
+{
+    int sig;
+
+    (void) arg;
+    for (;;) {
+        if (sigwait(&watch_signals, &sig) == 0)
+            cancel_all();
+    }
+    return 0;
+}
+
+static void watch_start(void)
+{
+    /* workers inherit the mask, so the signals only reach the watcher */
+    sigemptyset(&watch_signals);
+    sigaddset(&watch_signals, SIGINT);
+    sigaddset(&watch_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &watch_signals, &watch_saved);
+    if (pthread_create(&watcher, 0, watch_thread, 0))
+        die("cannot start signal watcher");
+}
+
+static void watch_stop(void)
+{
+    /* sigwait is a cancellation point */
+    pthread_cancel(watcher);
+    pthread_join(watcher, 0);
+    pthread_sigmask(SIG_SETMASK, &watch_saved, 0);
+}
+#endif
+
+int fb_execute_queue_all(transport **t, char **names, int count)
+{
+    Run *runs;
+    pthread_t *threads;
+    double start = now();
+    int failed = 0;
+    int i;
+
+    runs = calloc(count, sizeof(Run));
+    threads = calloc(count, sizeof(pthread_t));
+    if (runs == 0 || threads == 0) die("out of memory");
+
+    watched = t;
+    watched_count = count;
+    watch_start();
+
+    for (i = 0; i < count; i++) {
+        run_init(&runs[i], t[i], names[i]);
+        if (pthread_create(&threads[i], 0, run_thread, &runs[i]))
+            die("cannot start worker for %s", names[i]);
+    }
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i], 0);
+    drop_queue();
+    watch_stop();
+    watched_count = 0;
+
+    fprintf(stderr, "--------------------------------------------\n");
+    for (i = 0; i < count; i++) {
+        if (runs[i].status) {
+            failed++;
+            fprintf(stderr, "%s: FAILED [%7.3fs] (%s)\n", names[i],
+                    runs[i].elapsed, runs[i].error);
+        } else {
+            fprintf(stderr, "%s: OKAY [%7.3fs]", names[i], runs[i].elapsed);
+            if (runs[i].retries)
+                fprintf(stderr, " (%d retries)", runs[i].retries);
+            fputc('\n', stderr);
+        }
+    }
+    fprintf(stderr, "finished %d of %d devices. total time: %.3fs\n",
+            count - failed, count, now() - start);
+
+    free(runs);
+    free(threads);
+    return failed ? -1 : 0;
+}
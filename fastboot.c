@@ -42,6 +42,7 @@
 #include <sys/mman.h>
 
 #include "libzipfile/zipfile.h"
+#include "usb.h"
 #include "fastboot.h"
 #include "parser.h"
 #include "config.h"
@@ -58,8 +59,21 @@
 
 static usb_handle *usb = 0;
 static const char *serial = 0;
+/* -t: talk to host[:port] over TCP instead of USB */
+static const char *tcp_target = 0;
+/* -S: run against the built-in simulator */
+static const char *sim_spec = 0;
+/* -T: record the session to this trace file */
+static const char *trace_path = 0;
 static int wipe_data = 0;
 static unsigned short vendor_id = 0;
+static int queue_depth = 0;
+static int verbose = 0;
+/* -a: every matching device, opened by open_device */
+static int all_devices = 0;
+static usb_handle **devices = 0;
+static char **device_names = 0;
+static int device_count = 0;
 #if HAVE_COMPATIBILITY
 static int old_preos = 0;
 #endif
@@ -144,49 +158,229 @@ int match_fastboot(usb_ifc_info *info)
     return 0;
 }
 
-int list_devices_callback(usb_ifc_info *info)
+void print_device(usb_ifc_info *info)
 {
-    if (match_fastboot(info) == 0) {
-        char* serial = info->serial_number;
-        if (!info->writable) {
-            serial = "no permissions"; // like "adb devices"
-        }
-        if (!serial[0]) {
-            serial = "????????????";
+    char* serial = info->serial_number;
+    if (!info->writable) {
+        serial = "no permissions"; // like "adb devices"
+    }
+    if (!serial[0]) {
+        serial = "????????????";
+    }
+    // output compatible with "adb devices"
+    printf("%s\tfastboot\n", serial);
+}
+
+static void show_xfer_info(usb_handle *usb)
+{
+    usb_xfer_info info;
+
+    if (usb_get_xfer_info(usb, &info))
+        return;
+    fprintf(stderr, "usb: %u Mbit/s, max packet %u out, %u in\n",
+            info.speed, info.max_packet, info.in_packet);
+    fprintf(stderr, "usb: %u byte transfers, %u in flight\n",
+            info.xfer_size, info.queue_depth);
+    fprintf(stderr, "usb: zero-copy %s, scatter-gather %s, "
+            "no packet size limit %s\n",
+            info.zero_copy ? "yes" : "no",
+            info.scatter_gather ? "yes" : "no",
+            info.no_packet_size_lim ? "yes" : "no");
+}
+
+static void show_xfer_stats(const char *name, usb_handle *usb)
+{
+    usb_xfer_info info;
+
+    if (usb_get_xfer_info(usb, &info))
+        return;
+    fprintf(stderr, "%s: %u read retries, %u ms stalled\n",
+            name, info.retries, info.stall_ms);
+}
+
+void usage(void);
+/*
+ * right after a device is added its node may still be waiting for udev to
+ * grant us access, so rescan quickly for a while before going back to
+ * waiting for the next hotplug event.
+ */
+#define HOTPLUG_SETTLE_MS    20
+#define HOTPLUG_SETTLE_TRIES 50
+#define HOTPLUG_TIMEOUT_MS   1000
+
+static void setup_device(usb_handle *usb)
+{
+    if(queue_depth)
+        usb_set_queue_depth(usb, queue_depth);
+    if(verbose)
+        show_xfer_info(usb);
+}
+
+/* open every match of one scan, returns the first one */
+static usb_handle *open_all_devices(usb_ifc_info *list, int n)
+{
+    usb_handle *usb;
+    int i;
+
+    /* left from a pass that couldn't open any */
+    free(devices);
+    free(device_names);
+    devices = calloc(n, sizeof(*devices));
+    device_names = calloc(n, sizeof(*device_names));
+    if (devices == 0 || device_names == 0) die("out of memory");
+
+    for (i = 0; i < n; i++) {
+        usb = usb_open_ifc(&list[i]);
+        if (usb == 0) {
+            fprintf(stderr, "cannot open %s: %s\n", list[i].serial_number,
+                    strerror(errno));
+            continue;
         }
-        // output compatible with "adb devices"
-        printf("%s\tfastboot\n", serial);
+        setup_device(usb);
+        devcache_store(list[i].serial_number, list[i].port_path);
+        devices[device_count] = usb;
+        device_names[device_count] = strdup(list[i].serial_number[0] ?
+                list[i].serial_number : list[i].device_path);
+        device_count++;
     }
 
-    return -1;
+    return device_count ? devices[0] : 0;
 }
 
-int check_usb_devices(usb_ifc_info *info);
 usb_handle *open_device(void)
 {
     static usb_handle *usb = 0;
+    usb_ifc_info *list;
+    char port[64];
     int announce = 1;
+    int settle = 0;
+    int n, i;
 
     if(usb) return usb;
 
-    usb_open(check_usb_devices);
+    /* where the device asked for was plugged in last time */
+    port[0] = 0;
+    if(serial && !all_devices)
+        devcache_lookup(serial, port, sizeof(port));
+
+    /* listen before scanning, so an arrival in between isn't missed */
+    usb_hotplug_start();
 
     for(;;) {
-        usb = usb_open(match_fastboot);
-        if(usb) return usb;
+        /* a device keeps its port across a reboot, look there first and
+         * scan every bus only if it isn't (yet) there */
+        n = 0;
+        list = 0;
+        if(port[0])
+            n = usb_enumerate_port(port, match_fastboot, &list);
+        if(n <= 0) {
+            free(list);
+            n = usb_enumerate(match_fastboot, &list);
+        }
+        if (all_devices) {
+            if (n > 0)
+                usb = open_all_devices(list, n);
+        } else if (n > 1) {
+            fprintf(stderr, "Error: found more than one devices connected.\n");
+            for (i = 0; i < n; i++)
+                print_device(&list[i]);
+            fprintf(stderr, "Please specify one by using '-s' option\n\n");
+            usage();
+            exit(EXIT_FAILURE);
+        } else if (n == 1) {
+            usb = usb_open_ifc(&list[0]);
+            if (usb) {
+                setup_device(usb);
+                devcache_store(list[0].serial_number, list[0].port_path);
+            }
+        }
+        free(list);
+
+        if(usb) {
+            usb_hotplug_stop();
+            return usb;
+        }
         if(announce) {
             announce = 0;
             fprintf(stderr,"< waiting for device >\n");
         }
-        sleep(1);
+        if(settle > 0) {
+            settle--;
+            if(usb_hotplug_wait(HOTPLUG_SETTLE_MS) > 0)
+                settle = HOTPLUG_SETTLE_TRIES;
+        } else if(usb_hotplug_wait(HOTPLUG_TIMEOUT_MS) > 0) {
+            settle = HOTPLUG_SETTLE_TRIES;
+        }
+    }
+}
+
+/* the device the queue runs on, opened on first use */
+transport *open_transport(void)
+{
+    static transport *t = 0;
+
+    if (t) return t;
+
+    if (sim_spec) {
+        sim_config cfg;
+        if (sim_parse(sim_spec, &cfg))
+            die("invalid simulator settings '%s'", sim_spec);
+        t = sim_open(&cfg);
+        if (t == 0)
+            die("cannot start simulator: %s", strerror(errno));
+    } else if (tcp_target) {
+        t = tcp_connect(tcp_target);
+        if (t == 0)
+            die("cannot connect to %s: %s", tcp_target, strerror(errno));
+    } else {
+        usb = open_device();
+        t = usb_transport(usb);
+    }
+
+    if (trace_path) {
+        t = trace_open(t, trace_path);
+        if (t == 0)
+            die("cannot record to %s: %s", trace_path, strerror(errno));
     }
+    return t;
+}
+
+/* -a: a link to every device, opened on first use */
+static transport **all_links(void)
+{
+    static transport **links = 0;
+    char path[PATH_MAX];
+    int i;
+
+    if (links) return links;
+
+    if (tcp_target || sim_spec) die("-a works on USB devices only");
+    open_device();
+    links = calloc(device_count, sizeof(*links));
+    if (links == 0) die("out of memory");
+    for (i = 0; i < device_count; i++) {
+        links[i] = usb_transport(devices[i]);
+        if (trace_path == 0)
+            continue;
+        /* one trace per device, <file>.<n> in the order of the summary */
+        snprintf(path, sizeof(path), "%s.%d", trace_path, i);
+        links[i] = trace_open(links[i], path);
+        if (links[i] == 0)
+            die("cannot record to %s: %s", path, strerror(errno));
+    }
+    return links;
 }
 
 void list_devices(void) {
+    usb_ifc_info *list;
+    int n, i;
+
     // We don't actually open a USB device here,
-    // just getting our callback called so we can
-    // list all the connected devices.
-    usb_open(list_devices_callback);
+    // just list all the connected devices.
+    n = usb_enumerate(match_fastboot, &list);
+    for (i = 0; i < n; i++)
+        print_device(&list[i]);
+    free(list);
 }
 
 void usage(void)
@@ -205,42 +399,44 @@ void usage(void)
             "  devices                                  list all connected devices\n"
             "  reboot                                   reboot device normally\n"
             "  reboot-bootloader                        reboot device into bootloader\n"
+            "  replay <trace>                           send a recorded session again, images\n"
+            "                                           are replaced by a fill pattern\n"
             "\n"
             "options:\n"
             "  -h|--help                                show this help message\n"
             "  -v|--version                             print fastboot version\n"
             "  -s|--serial <serial number>              specify device serial number\n"
             "  -i|--id <vendor id>                      specify a custom USB vendor id\n"
+            "  -u|--urbs <count>                        USB writes kept in flight (default 8)\n"
+            "  -V|--verbose                             show USB transfer settings\n"
+            "  -a|--all                                 run on all matching devices at once\n"
+            "  -t|--tcp <host[:port]>                   talk to a device over TCP (port 5554)\n"
+            "  -S|--sim <settings>                      talk to a simulated device, settings are\n"
+            "                                           'default' or latency=<us>,link=<MB/s>,\n"
+            "                                           write=<MB/s>,maxdl=<bytes>,pull=<bytes>,\n"
+            "                                           noseg,fork\n"
+            "  -T|--trace <file>                        record the session to a wire trace\n"
+            "                                           (<file>.<n> per device with -a)\n"
+            "  -w|--window <MB>                         image data kept in memory once sent\n"
+            "                                           (default 10, 0 keeps all of it)\n"
+            "  -c|--checksum <query>                    check each flash against the CRC32 the\n"
+            "                                           device returns for <query><partition>,\n"
+            "                                           e.g. 'getvar:crc32:'\n"
 #if HAVE_COMPATIBILITY
             "  -o|--old                                 communicate with old preos-runtime\n"
 #endif
         );
 }
 
-int check_usb_devices(usb_ifc_info *info)
-{
-    static int nr_usb = 0;
-
-    if (match_fastboot(info) == 0)
-        nr_usb++;
-
-    if (nr_usb > 1) {
-        fprintf(stderr, "Error: found more than one devices connected.\n");
-        list_devices();
-        fprintf(stderr, "Please specify one by using '-s' option\n\n");
-        usage();
-        exit(EXIT_FAILURE);
-    }
-
-    return -1;
-}
-
-void *unzip_file(zipfile_t zip, const char *name, unsigned *sz)
+/* as unzip_file, @mapped tells whether the result was mmap()ed */
+static void *unzip_entry(zipfile_t zip, const char *name, unsigned *sz,
+                         int *mapped)
 {
     void *data;
     zipentry_t entry;
     unsigned datasz;
 
+    *mapped = 0;
     entry = lookup_zipentry(zip, name);
     if (entry == NULL) {
         //fprintf(stderr, "archive does not contain '%s'\n", name);
@@ -280,6 +476,7 @@ void *unzip_file(zipfile_t zip, const char *name, unsigned *sz)
             return 0;
         }
 
+        *mapped = 1;
         return addr;
     }
 
@@ -292,6 +489,102 @@ void *unzip_file(zipfile_t zip, const char *name, unsigned *sz)
     return data;
 }
 
+void *unzip_file(zipfile_t zip, const char *name, unsigned *sz)
+{
+    int mapped;
+
+    return unzip_entry(zip, name, sz, &mapped);
+}
+
+/* partition image inflated on the fly while it is being sent */
+struct zip_source {
+    zipentry_t entry;
+    zipstream_t stream;
+    unsigned left;
+};
+
+/* inflate from the start again, for a retry */
+static int zip_rewind(void *cookie)
+{
+    struct zip_source *src = cookie;
+
+    close_zipentry_stream(src->stream);
+    src->stream = open_zipentry_stream(src->entry);
+    if (src->stream == 0)
+        return -1;
+    src->left = get_zipentry_size(src->entry);
+    return 0;
+}
+
+static int zip_fill(void *cookie, void *buf, int len)
+{
+    struct zip_source *src = cookie;
+    int n;
+
+    n = read_zipentry_stream(src->stream, buf, len);
+    if (n != len) {
+        /* corrupt or truncated entry */
+        errno = EIO;
+        return -1;
+    }
+
+    src->left -= n;
+    if (src->left == 0) {
+        close_zipentry_stream(src->stream);
+        src->stream = 0;
+    }
+    return n;
+}
+
+/* the flash is done with the entry, sent or not */
+static void zip_release(void *cookie)
+{
+    struct zip_source *src = cookie;
+
+    close_zipentry_stream(src->stream);
+    free(src);
+}
+
+/*
+ * queue a streaming flash of zip entry @name to partition @ptn, the entry
+ * is decompressed directly into the USB transfer buffers instead of being
+ * unzipped into memory first. Returns 0 if there is no such entry.
+ */
+int queue_zip_flash(zipfile_t zip, const char *name, const char *ptn)
+{
+    zipentry_t entry;
+    struct zip_source *src;
+    void *data;
+    unsigned sz;
+    int mapped;
+
+    entry = lookup_zipentry(zip, name);
+    if (entry == NULL)
+        return 0;
+
+    /* a stream can only be read once, unzip it for all devices to share */
+    if (all_devices) {
+        data = unzip_entry(zip, name, &sz, &mapped);
+        if (data == 0)
+            die("failed to unzip '%s' from archive", name);
+        fb_queue_stream_flash_image(ptn, mapped ? image_from_map(data, sz) :
+                                    image_from_heap(data, sz));
+        return 1;
+    }
+
+    src = calloc(1, sizeof(*src));
+    if (src == 0) die("out of memory");
+    src->entry = entry;
+    src->stream = open_zipentry_stream(entry);
+    if (src->stream == 0)
+        die("failed to decompress '%s' from archive", name);
+    src->left = get_zipentry_size(entry);
+
+    fb_queue_stream_flash_fill(ptn, zip_fill, zip_rewind, zip_release, src,
+                               src->left);
+    return 1;
+}
+
 static char *strip(char *s)
 {
     int n;
@@ -312,6 +605,40 @@ void queue_info_dump(void)
     fb_queue_notice("--------------------------------------------");
 }
 
+/* The IFWI major version of the device(s). One package goes to every
+ * device, so with -a they have to agree on it.
+ */
+static void query_ifwi(char *ver, unsigned size)
+{
+    char other[FB_RESPONSE_SZ + 1];
+    transport **links;
+    char *pc;
+    int i;
+
+    ver[0] = 0;
+    if (!all_devices) {
+        fb_queue_query_save("ifwi", ver, size);
+        fb_execute_queue(open_transport());
+        if ((pc = strchr(ver, '.')))
+            *pc = 0;
+        return;
+    }
+
+    links = all_links();
+    for (i = 0; i < device_count; i++) {
+        other[0] = 0;
+        fb_queue_query_save("ifwi", other, sizeof(other));
+        fb_execute_queue(links[i]);
+        if ((pc = strchr(other, '.')))
+            *pc = 0;
+        if (i == 0)
+            snprintf(ver, size, "%s", other);
+        else if (strcmp(ver, other))
+            die("%s has IFWI %s but %s has %s, flash them separately",
+                device_names[0], ver, device_names[i], other);
+    }
+}
+
 void do_flashall(char *fn)
 {
     void *zdata;
@@ -321,17 +648,11 @@ void do_flashall(char *fn)
     zipfile_t zip;
     struct config conf;
     char ver[FB_RESPONSE_SZ + 1];
-    char *pc;
     int status;
 
     /* get target IFWI major version */
     fprintf(stderr, "query system info...\n");
-    fb_queue_query_save("ifwi", ver, sizeof(ver));
-    usb = open_device();
-    fb_execute_queue(usb);
-
-    if ((pc = strchr(ver, '.')))
-        *pc = 0;
+    query_ifwi(ver, sizeof(ver));
 
     queue_info_dump();
 
@@ -358,60 +679,31 @@ void do_flashall(char *fn)
 
     /*
      * every component is optional, no need to check
-     * the second of unzip_file argument if it's not null
+     * the second of queue_zip_flash argument if it's not null
      * memcmp can handle NULL pointer.
      */
-    data = unzip_file(zip, conf.fwr_dnx, &sz);
-    if (data != 0)
-        fb_queue_stream_flash("dnx", data, sz);
-
-    data = unzip_file(zip, conf.ifwi, &sz);
-    if (data != 0)
-        fb_queue_stream_flash("ifwi", data, sz);
-
-    data = unzip_file(zip, conf.boot, &sz);
-    if (data != 0)
-        fb_queue_stream_flash("boot", data, sz);
-
-    data = unzip_file(zip, conf.preos, &sz);
-    if (data != 0)
-        fb_queue_stream_flash("preos", data, sz);
+    queue_zip_flash(zip, conf.fwr_dnx, "dnx");
+    queue_zip_flash(zip, conf.ifwi, "ifwi");
+    queue_zip_flash(zip, conf.boot, "boot");
+    queue_zip_flash(zip, conf.preos, "preos");
 
     /* try to get platform image.
      * first, try gziped.
      * second, try bzip2.
      * at last, try raw image
      */
-    data = unzip_file(zip, PLATFORM_IMG ".gz", &sz);
-    if (data == 0) {
-        data = unzip_file(zip, PLATFORM_IMG ".bz2", &sz);
-        if (data == 0) {
-            data = unzip_file(zip, PLATFORM_IMG, &sz);
-        }
-    }
-    if (data != 0)
-        fb_queue_stream_flash("platform", data, sz);
+    if (!queue_zip_flash(zip, PLATFORM_IMG ".gz", "platform") &&
+        !queue_zip_flash(zip, PLATFORM_IMG ".bz2", "platform"))
+        queue_zip_flash(zip, PLATFORM_IMG, "platform");
 
     /* data and csa partition image */
-    data = unzip_file(zip, DATA_IMG ".gz", &sz);
-    if (data == 0) {
-        data = unzip_file(zip, DATA_IMG ".bz2", &sz);
-        if (data == 0) {
-            data = unzip_file(zip, DATA_IMG, &sz);
-        }
-    }
-    if (data != 0)
-        fb_queue_stream_flash("data", data, sz);
+    if (!queue_zip_flash(zip, DATA_IMG ".gz", "data") &&
+        !queue_zip_flash(zip, DATA_IMG ".bz2", "data"))
+        queue_zip_flash(zip, DATA_IMG, "data");
 
-    data = unzip_file(zip, CSA_IMG ".gz", &sz);
-    if (data == 0) {
-        data = unzip_file(zip, CSA_IMG ".bz2", &sz);
-        if (data == 0) {
-            data = unzip_file(zip, CSA_IMG, &sz);
-        }
-    }
-    if (data != 0)
-        fb_queue_stream_flash("csa", data, sz);
+    if (!queue_zip_flash(zip, CSA_IMG ".gz", "csa") &&
+        !queue_zip_flash(zip, CSA_IMG ".bz2", "csa"))
+        queue_zip_flash(zip, CSA_IMG, "csa");
 }
 
 void do_send_signature(char *fn)
@@ -435,7 +727,7 @@ void do_send_signature(char *fn)
 #define skip(n) do { argc -= (n); argv += (n); } while (0)
 #define require(n) do { if (argc < (n)) {usage(); exit(1);}} while (0)
 
-int fd_pull;
+int fd_pull = -1;
 char fn_pull[PATH_MAX] = "";
 int do_oem_command(int argc, char **argv)
 {
@@ -454,6 +746,8 @@ int do_oem_command(int argc, char **argv)
                 fb_queue_download(argv[2], data, sz);
             }
         } else if (0 == strcmp(argv[1], "pull")) {
+            if (all_devices)
+                die("oem pull can't be used with several devices");
             if (argc > 3)
                 strncpy(fn_pull, argv[3], sizeof(fn_pull));
             else if (argc > 2 && strcmp(argv[2], "-h") &&
@@ -487,9 +781,8 @@ int main(int argc, char **argv)
 {
     int wants_reboot = 0;
     int wants_reboot_bootloader = 0;
-    void *data;
-    unsigned sz;
     int status;
+    int i;
 
     skip(1);
     if (argc == 0) {
@@ -530,6 +823,49 @@ int main(int argc, char **argv)
                 die("invalid vendor id '%s'", argv[1]);
             vendor_id = (unsigned short)val;
             skip(2);
+        } else if(!strcmp(*argv, "-a") || !strcmp(*argv, "--all")) {
+            all_devices = 1;
+            skip(1);
+        } else if(!strcmp(*argv, "-V") || !strcmp(*argv, "--verbose")) {
+            verbose = 1;
+            skip(1);
+        } else if(!strcmp(*argv, "-t") || !strcmp(*argv, "--tcp")) {
+            require(2);
+            tcp_target = argv[1];
+            skip(2);
+        } else if(!strcmp(*argv, "-S") || !strcmp(*argv, "--sim")) {
+            require(2);
+            sim_spec = argv[1];
+            skip(2);
+        } else if(!strcmp(*argv, "-c") || !strcmp(*argv, "--checksum")) {
+            require(2);
+            fb_set_checksum_query(argv[1]);
+            skip(2);
+        } else if(!strcmp(*argv, "-T") || !strcmp(*argv, "--trace")) {
+            require(2);
+            trace_path = argv[1];
+            skip(2);
+        } else if(!strcmp(*argv, "replay")) {
+            require(2);
+            return trace_replay(open_transport(), argv[1]) ? 1 : 0;
+        } else if(!strcmp(*argv, "-w") || !strcmp(*argv, "--window")) {
+            char *endptr = NULL;
+            long val;
+            require(2);
+            val = strtol(argv[1], &endptr, 0);
+            if (!endptr || *endptr != '\0' || val < 0 || val > 4095)
+                die("invalid window size '%s'", argv[1]);
+            image_set_window((unsigned)val * 1024 * 1024);
+            skip(2);
+        } else if(!strcmp(*argv, "-u") || !strcmp(*argv, "--urbs")) {
+            char *endptr = NULL;
+            long val;
+            require(2);
+            val = strtol(argv[1], &endptr, 0);
+            if (!endptr || *endptr != '\0' || val < 1)
+                die("invalid urb count '%s'", argv[1]);
+            queue_depth = (int)val;
+            skip(2);
         } else if(!strcmp(*argv, "getvar")) {
             /* when argc == 1, just list all available variables */
             if (argc == 1) {
@@ -562,18 +898,13 @@ int main(int argc, char **argv)
             } else {
                 char *pname = argv[1];
                 char *fname = 0;
+                image *img;
                 require(3);
                 fname = argv[2];
                 skip(3);
-                data = load_file(fname, &sz);
-                if (data == 0) {
-                    int fd = open(fname, O_RDONLY);
-                    if (fd == -1) die("cannot open %s for read: %m\n", fname);
-                    sz = lseek(fd, 0, SEEK_END);
-                    data = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
-                    if (data == MAP_FAILED) die("cannot map '%s': %s\n", fname, strerror(errno));
-                }
-                fb_queue_stream_flash(pname, data, sz);
+                img = image_load(fname);
+                if (img == 0) die("cannot load '%s': %s\n", fname, strerror(errno));
+                fb_queue_stream_flash_image(pname, img);
             }
         } else if(!strcmp(*argv, "flashall")) {
             require(2);
@@ -604,8 +935,23 @@ int main(int argc, char **argv)
         fb_queue_command("reboot-bootloader", "rebooting into bootloader");
     }
 
-    usb = open_device();
+    if (all_devices) {
+        transport **links = all_links();
+
+        /* every device reads the images from the start */
+        image_set_window(0);
+        status = fb_execute_queue_all(links, device_names, device_count);
+    } else {
+        status = fb_execute_queue(open_transport());
+    }
 
-    status = fb_execute_queue(usb);
+    if (verbose) {
+        if (all_devices) {
+            for (i = 0; i < device_count; i++)
+                show_xfer_stats(device_names[i], devices[i]);
+        } else if (usb) {
+            show_xfer_stats("usb", usb);
+        }
+    }
     return (status) ? 1 : 0;
 }
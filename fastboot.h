@@ -29,18 +29,144 @@
 #ifndef _FASTBOOT_H_
 #define _FASTBOOT_H_
 
-#include "usb.h"
+#include "transport.h"
 
 /* protocol.c - fastboot protocol */
-int fb_command(usb_handle *usb, const char *cmd);
-int fb_command_response(usb_handle *usb, const char *cmd, char *response);
-int fb_download_data(usb_handle *usb, const void *data, unsigned size);
-char *fb_get_error(void);
-
 #define FB_COMMAND_SZ 64
 #define FB_RESPONSE_SZ 64
+/* a FILE reply carries data behind its header, so a status can fill a
+ * whole high-speed packet, more than the 64 bytes of a response */
+#define FB_STATUS_SZ 512
+
+typedef void (*fb_info_func)(void *cookie, const char *info);
+typedef struct fb_session fb_session;
+
+/* One conversation with a device: its transport, buffers, error and
+ * callbacks. Sessions share nothing, each can run on its own thread.
+ */
+struct fb_session
+{
+    transport *t;
+
+    char error[128];
+    int link_failed;                /* the error closed the link */
+    int in_data;                    /* ... after the DATA reply */
+
+    fb_info_func info;              /* INFO lines, 0 prints them */
+    void *info_cookie;
+    int pull_fd;                    /* oem pull data, -1 refuses it */
+
+    /* with @hash set, the data phases sent add to @crc (zlib crc32,
+     * start it at 0) a piece at a time as they are handed to the
+     * transport */
+    int hash;
+    unsigned long crc;
+
+    unsigned char status[FB_STATUS_SZ + 1];
+};
+
+void fb_session_init(fb_session *s, transport *t);
+int fb_session_command(fb_session *s, const char *cmd, char *response);
+int fb_session_download(fb_session *s, const void *data, unsigned size);
+/* part of a download over max-download-size, for devices that have
+ * getvar:segments; the device appends it at @offset */
+int fb_session_download_part(fb_session *s, const void *data, unsigned size,
+        unsigned offset);
+int fb_session_stream_flash(fb_session *s, const char *cmd,
+        const void *data, unsigned size);
+int fb_session_stream_flash_fill(fb_session *s, const char *cmd,
+        transport_fill_func fill, void *cookie, unsigned size);
+int fb_session_stream_flash_next(fb_session *s, const char *cmd,
+        const transport_source *src, unsigned size);
+
+/* the same on a per-thread session, INFO to stdout and pulls to fd_pull */
+int fb_command(transport *t, const char *cmd);
+int fb_command_response(transport *t, const char *cmd, char *response);
+int fb_download_data(transport *t, const void *data, unsigned size);
+int fb_stream_flash(transport *t, const char *cmd,
+        const void *data, unsigned size);
+int fb_stream_flash_fill(transport *t, const char *cmd,
+        transport_fill_func fill, void *cookie, unsigned size);
+char *fb_get_error(void);
+/* the last failure was the link's, not a FAIL from the device */
+int fb_link_failed(void);
+
+/* crc32.c - zlib's crc32(), on the CPU's CRC or carry-less multiply
+ * instructions where it has them */
+unsigned long fb_crc32(unsigned long crc, const void *buf, unsigned len);
+
+/* tcp.c - fastboot over TCP */
+/* @target is host[:port], the port defaults to 5554 */
+transport *tcp_connect(const char *target);
+/* speak fastboot over an already connected stream socket */
+transport *tcp_open_fd(int fd);
+
+/* simulator.c - fake device for benchmarks and tests */
+typedef struct sim_config sim_config;
+
+struct sim_config
+{
+    unsigned latency_us;            /* delay before each command */
+    unsigned long long link_bps;    /* link speed, 0 unlimited */
+    unsigned long long write_bps;   /* storage speed, 0 instant */
+    unsigned max_download;          /* reported max-download-size */
+    unsigned pull_size;             /* bytes returned by oem pull */
+    int no_segments;                /* like a device without getvar:segments */
+    int process;                    /* child process instead of a thread */
+};
+
+/* "latency=<us>,link=<MB/s>,write=<MB/s>,maxdl=<bytes>,pull=<bytes>,
+ * noseg,fork" */
+int sim_parse(const char *spec, sim_config *cfg);
+transport *sim_open(const sim_config *cfg);
+
+/* trace.c - wire traces of a session */
+/* record every call on @inner to the trace file @path */
+transport *trace_open(transport *inner, const char *path);
+/* send the host side of a trace again, with its original timing */
+int trace_replay(transport *t, const char *path);
+
+/* image.c - image data, released as it is sent */
+typedef struct image image;
+typedef struct image_reader image_reader;
+
+/* one pass over an image, the cookie of image_fill */
+struct image_reader
+{
+    image *img;
+    unsigned long long offset;
+};
+
+#define IMAGE_DEFAULT_WINDOW (10 * 1024 * 1024)
+
+image *image_load(const char *fn);
+image *image_from_heap(void *data, unsigned long long size);
+image *image_from_map(void *data, unsigned long long size);
+unsigned long long image_size(image *img);
+void image_free(image *img);
+int image_fill(void *cookie, void *buf, int len);
+/* make the whole image readable again for another pass, -1 if the sent
+ * part is gone for good */
+int image_rewind(image *img);
+/* sent bytes kept resident, 0 keeps the whole image (for several readers) */
+void image_set_window(unsigned bytes);
+
+/* ring.c - produce data on a thread of its own while it is sent */
+typedef struct chunk_ring chunk_ring;
+
+/* run @fill for @total bytes ahead of the transfer, into a few recycled
+ * chunks, from @t's buffers where it has them; ring_next and ring_release
+ * (a transport_source with the ring as cookie) lend them out to be sent */
+chunk_ring *ring_start(transport *t, transport_fill_func fill, void *cookie,
+                       unsigned long long total);
+int ring_next(void *cookie, const void **buf, int len, int wait);
+void ring_release(void *cookie, int len);
+/* stop the producer, also if not everything was taken, and free the ring */
+void ring_finish(chunk_ring *r);
+#define RING_MIN_SIZE (2 * 1024 * 1024)
 
 /* engine.c - high level command queue engine */
+double now(void);
 void fb_queue_flash(const char *ptn, void *data, unsigned sz);;
 void fb_queue_erase(const char *ptn);
 void fb_queue_display(const char *var, const char *prettyname);
@@ -48,11 +174,37 @@ void fb_queue_query_save(const char *var, char *dest, unsigned dest_size);
 void fb_queue_command(const char *cmd, const char *msg);
 void fb_queue_download(const char *name, void *data, unsigned size);
 void fb_queue_notice(const char *notice);
-int fb_execute_queue(usb_handle *usb);
+int fb_execute_queue(transport *t);
+int fb_execute_queue_all(transport **t, char **names, int count);
 void fb_queue_stream_flash(const char *ptn, void *data, unsigned sz);
+void fb_queue_stream_flash_fill(const char *ptn, transport_fill_func fill,
+        int (*rewind)(void *cookie), void (*release)(void *cookie),
+        void *cookie, unsigned sz);
+void fb_queue_stream_flash_image(const char *ptn, image *img);
+/* after each flash send @query with the partition name appended, e.g.
+ * "getvar:crc32:", and compare the CRC32 in the reply with what was sent */
+void fb_set_checksum_query(const char *query);
+
+/* pull.c - writes data pulled from the device behind the transfer */
+typedef struct pull_sink pull_sink;
+
+#define PULL_BUFFER_SIZE (1024 * 1024)
+
+pull_sink *pull_start(int fd);
+/* the next buffer to fill, PULL_BUFFER_SIZE bytes; waits for the writer */
+void *pull_buffer(pull_sink *p);
+/* queue @len bytes of the buffer for writing, -1 once a write failed */
+int pull_commit(pull_sink *p, unsigned len);
+/* wait for all writes, with @report print the throughput */
+int pull_finish(pull_sink *p, int report);
+
+/* devcache.c - the port each device serial was last seen on */
+int devcache_lookup(const char *serial, char *port, int size);
+void devcache_store(const char *serial, const char *port);
 
 /* util stuff */
 void die(const char *fmt, ...);
+void *load_file(const char *fn, unsigned *sz);
 
 /* file descriptor and file name of file will be saved by 'oem pull' */
 extern int fd_pull;
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "fastboot.h"
+
+/* Image data sent to the device once, in order. Pages that went out are
+ * given back to the system so a large image never stays resident as a
+ * whole; how depends on where the memory came from. A file is not mapped
+ * at all but read piece by piece into the transfer buffers.
+ */
+struct image
+{
+    unsigned char *data;
+    unsigned long long size;
+    int kind;
+
+    /* first byte that is still resident */
+    unsigned char *freed;
+
+    /* file behind a mapped image, to map released pages again, or the
+     * file an IMAGE_FILE is read from */
+    int fd;
+};
+
+#define IMAGE_HEAP   1      /* malloc()ed, pages are dropped by madvise */
+#define IMAGE_MAPPED 2      /* mmap()ed, sent pages are unmapped */
+#define IMAGE_FILE   3      /* pread() from fd, sent pages leave the cache */
+
+/* how far a file is read ahead of the transfer */
+#define IMAGE_READAHEAD (4 * 1024 * 1024)
+
+/* bytes sent before they are released, 0 keeps everything */
+static unsigned release_window = IMAGE_DEFAULT_WINDOW;
+
+void image_set_window(unsigned bytes)
+{
+    release_window = bytes;
+}
+
+static image *image_new(void *data, unsigned long long size, int kind)
+{
+    image *img;
+
+    img = calloc(1, sizeof(image));
+    if (img == 0) return 0;
+
+    img->data = data;
+    img->size = size;
+    img->kind = kind;
+    img->freed = data;
+    img->fd = -1;
+
+#ifndef _WIN32
+    /* read once front to back, let the kernel read ahead further */
+    if (kind == IMAGE_MAPPED && size)
+        madvise(data, size, MADV_SEQUENTIAL);
+#endif
+    return img;
+}
+
+image *image_from_heap(void *data, unsigned long long size)
+{
+    return image_new(data, size, IMAGE_HEAP);
+}
+
+image *image_from_map(void *data, unsigned long long size)
+{
+    return image_new(data, size, IMAGE_MAPPED);
+}
+
+#ifdef _WIN32
+image *image_load(const char *fn)
+{
+    void *data;
+    unsigned sz;
+
+    data = load_file(fn, &sz);
+    if (data == 0) return 0;
+    return image_from_heap(data, sz);
+}
+
+static void image_release(image *img, unsigned long long upto)
+{
+}
+
+int image_rewind(image *img)
+{
+    return 0;
+}
+#else
+image *image_load(const char *fn)
+{
+    image *img;
+    off_t sz;
+    int fd;
+    int errno_tmp;
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0) return 0;
+
+    sz = lseek(fd, 0, SEEK_END);
+    if (sz < 0) {
+        errno_tmp = errno;
+        close(fd);
+        errno = errno_tmp;
+        return 0;
+    }
+
+    /* read at the offset of each reader, nothing in memory up front */
+    img = image_new(0, sz, IMAGE_FILE);
+    if (img == 0) {
+        close(fd);
+        errno = ENOMEM;
+        return 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    img->fd = fd;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return img;
+}
+
+int image_rewind(image *img)
+{
+    unsigned char *data;
+    unsigned char *end;
+    size_t len = img->size ? img->size : 1;
+
+    /* a file is read at any offset, nothing to restore */
+    if (img->freed == img->data || img->kind == IMAGE_FILE)
+        return 0;
+
+    /* heap pages given back are gone, only a file can be read again */
+    if (img->kind != IMAGE_MAPPED || img->fd < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    /* somewhere new, the released range may be in use by now */
+    data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, img->fd, 0);
+    if (data == MAP_FAILED)
+        return -1;
+    madvise(data, len, MADV_SEQUENTIAL);
+
+    end = img->data + len;
+    if (end > img->freed)
+        munmap(img->freed, end - img->freed);
+    img->data = data;
+    img->freed = data;
+    return 0;
+}
+
+/* give back the whole pages below offset @upto */
+static void image_release(image *img, unsigned long long upto)
+{
+    unsigned long page = sysconf(_SC_PAGE_SIZE);
+    unsigned long lo = (unsigned long) img->freed;
+    unsigned long hi = (unsigned long) (img->data + upto);
+
+    lo = (lo + page - 1) & ~(page - 1);
+    hi &= ~(page - 1);
+    if (hi <= lo)
+        return;
+
+    if (img->kind == IMAGE_MAPPED) {
+        if (munmap((void*) lo, hi - lo))
+            return;
+    } else {
+        /* inside the allocation only, malloc's own headers stay intact */
+        if (madvise((void*) lo, hi - lo, MADV_DONTNEED))
+            return;
+    }
+    img->freed = (unsigned char*) hi;
+}
+#endif
+
+unsigned long long image_size(image *img)
+{
+    return img->size;
+}
+
+void image_free(image *img)
+{
+    if (img == 0) return;
+
+    if (img->kind == IMAGE_MAPPED) {
+#ifndef _WIN32
+        unsigned char *end = img->data + (img->size ? img->size : 1);
+        if (end > img->freed)
+            munmap(img->freed, end - img->freed);
+        if (img->fd >= 0)
+            close(img->fd);
+#endif
+    } else if (img->kind == IMAGE_FILE) {
+        close(img->fd);
+    } else {
+        free(img->data);
+    }
+    free(img);
+}
+
+#ifndef _WIN32
+/*
+ * Read the next @len bytes of a file image. Crossing a readahead boundary
+ * asks for the next stretch to be read in the background, and with a
+ * release window drops what was sent from the page cache. Only the
+ * reader's own offset is used, readers of one image don't share state.
+ */
+static int file_fill(image_reader *rd, unsigned char *buf, int len)
+{
+    image *img = rd->img;
+    unsigned long long at = rd->offset;
+    unsigned long long from, next;
+    ssize_t n;
+    int done = 0;
+
+    while (done < len) {
+        n = pread(img->fd, buf + done, len - done, at + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* the file got shorter since it was opened */
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    rd->offset += len;
+
+#ifdef POSIX_FADV_WILLNEED
+    from = at - at % IMAGE_READAHEAD;
+    next = rd->offset - rd->offset % IMAGE_READAHEAD;
+    if (at == 0 || next > from) {
+        posix_fadvise(img->fd, next, 2 * IMAGE_READAHEAD,
+                      POSIX_FADV_WILLNEED);
+        if (release_window && next > release_window) {
+            from = from > release_window ? from - release_window : 0;
+            posix_fadvise(img->fd, from, next - release_window - from,
+                          POSIX_FADV_DONTNEED);
+        }
+    }
+#else
+    (void) from;
+    (void) next;
+#endif
+    return len;
+}
+#endif
+
+int image_fill(void *cookie, void *buf, int len)
+{
+    image_reader *rd = cookie;
+    image *img = rd->img;
+
+    if (len < 0 || (unsigned long long) len > img->size - rd->offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifndef _WIN32
+    if (img->kind == IMAGE_FILE)
+        return file_fill(rd, buf, len);
+#endif
+
+    memcpy(buf, img->data + rd->offset, len);
+    rd->offset += len;
+
+    if (release_window &&
+        rd->offset - (img->freed - img->data) >= release_window)
+        image_release(img, rd->offset);
+    return len;
+}
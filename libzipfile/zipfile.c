@@ -200,6 +200,85 @@ decompress_zipentry(zipentry_t e, void* buf, int bufsize)
     }
 }
 
+typedef struct Zipstream {
+    Zipentry* entry;
+    unsigned int offset;        // bytes of output produced so far
+    z_stream zstream;
+} Zipstream;
+
+zipstream_t
+open_zipentry_stream(zipentry_t e)
+{
+    Zipentry* entry = (Zipentry*)e;
+    Zipstream* stream;
+
+    if (entry->compressionMethod != STORED &&
+            entry->compressionMethod != DEFLATED)
+        return NULL;
+
+    stream = calloc(1, sizeof(Zipstream));
+    if (stream == NULL) return NULL;
+    stream->entry = entry;
+
+    if (entry->compressionMethod == DEFLATED) {
+        stream->zstream.next_in = (void*)entry->data;
+        stream->zstream.avail_in = entry->compressedSize;
+        // no zlib header, see uninflate()
+        if (inflateInit2(&stream->zstream, -MAX_WBITS) != Z_OK) {
+            free(stream);
+            return NULL;
+        }
+    }
+
+    return stream;
+}
+
+int
+read_zipentry_stream(zipstream_t s, void* buf, int len)
+{
+    Zipstream* stream = (Zipstream*)s;
+    Zipentry* entry = stream->entry;
+    unsigned int left = entry->uncompressedSize - stream->offset;
+    int zerr;
+
+    if (len < 0) return -1;
+    if ((unsigned int)len > left) len = left;
+    if (len == 0) return 0;
+
+    if (entry->compressionMethod == STORED) {
+        memcpy(buf, entry->data + stream->offset, len);
+        stream->offset += len;
+        return len;
+    }
+
+    stream->zstream.next_out = (Bytef*) buf;
+    stream->zstream.avail_out = len;
+    while (stream->zstream.avail_out > 0) {
+        zerr = inflate(&stream->zstream, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END)
+            break;
+        if (zerr != Z_OK) {
+            fprintf(stderr, "inflate failed: %d\n", zerr);
+            return -1;
+        }
+    }
+
+    len -= stream->zstream.avail_out;
+    stream->offset += len;
+    return len;
+}
+
+void
+close_zipentry_stream(zipstream_t s)
+{
+    Zipstream* stream = (Zipstream*)s;
+
+    if (stream == NULL) return;
+    if (stream->entry->compressionMethod == DEFLATED)
+        inflateEnd(&stream->zstream);
+    free(stream);
+}
+
 void
 dump_zipfile(FILE* to, zipfile_t file)
 {
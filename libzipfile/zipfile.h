@@ -25,6 +25,7 @@ extern "C" {
 
 typedef void* zipfile_t;
 typedef void* zipentry_t;
+typedef void* zipstream_t;
 
 // Provide a buffer.  Returns NULL on failure.
 zipfile_t init_zipfile(const void* data, size_t size);
@@ -47,6 +48,18 @@ char* get_zipentry_name(zipentry_t entry);
 // by get_zipentry_size.  Returns nonzero on failure.
 int decompress_zipentry(zipentry_t entry, void* buf, int bufsize);
 
+// Open a sequential reader over an entry so it can be decompressed piece
+// by piece into the caller's buffers.  Returns NULL on failure.
+zipstream_t open_zipentry_stream(zipentry_t entry);
+
+// Decompress the next len bytes into buf.  Returns the number of bytes
+// produced (less than len only at the end of the entry), 0 once the whole
+// entry has been read, or -1 on error.
+int read_zipentry_stream(zipstream_t stream, void* buf, int len);
+
+// Release the reader.
+void close_zipentry_stream(zipstream_t stream);
+
 // iterate through the entries in the zip file.  pass a pointer to
 // a void* initialized to NULL to start.  Returns NULL when done
 zipentry_t iterate_zipfile(zipfile_t file, void** cookie);
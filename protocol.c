@@ -36,66 +36,168 @@
 
 #include "fastboot.h"
 
-static char ERROR[128];
+/* Transfer deadlines, in ms. A device that stops answering fails the
+ * command instead of hanging forever. Status waits are long since flashing
+ * or erasing can keep the device busy for minutes; every INFO line starts
+ * a new wait.
+ */
+#define COMMAND_TIMEOUT 5000
+#define STATUS_TIMEOUT (10 * 60 * 1000)
+/* at least 1MB/s over a fixed allowance */
+#define PAYLOAD_TIMEOUT(size) (10000 + (size) / 1000)
 
-char *fb_get_error(void)
+/* the session behind the fb_* calls that take a bare transport, one per
+ * thread like the globals they replaced */
+static __thread fb_session DEFAULT;
+
+void fb_session_init(fb_session *s, transport *t)
 {
-    return ERROR;
+    memset(s, 0, sizeof(*s));
+    s->t = t;
+    s->pull_fd = -1;
 }
 
-static int save_to_file(int fd, void *data, unsigned long sz)
+/* the device is out of step with us, only a recovery gets it back */
+static void drop_link(fb_session *s)
 {
-    if (fd < 0 || sz < 0)
-        return -1;
+    s->link_failed = 1;
+    transport_close(s->t);
+}
 
-    if (write(fd, data, sz) != sz) {
-        fprintf(stderr, "write failed.\n");
-        return -1;
+/* read and drop the rest of a FILE block that isn't saved, so the next
+ * read starts at a status again */
+static int pull_drain(fb_session *s, unsigned left)
+{
+    unsigned n;
+    int len;
+
+    while (left > 0) {
+        n = left > FB_STATUS_SZ ? FB_STATUS_SZ : left;
+        len = transport_read(s->t, s->status, n, PAYLOAD_TIMEOUT(n), 0);
+        if (len <= 0) {
+            sprintf(s->error, "pull read failed (%s)",
+                    len < 0 ? strerror(errno) : "no data");
+            return -1;
+        }
+        left -= len;
+    }
+    return 0;
+}
+
+/*
+ * Receive one FILE block of an oem pull, @r bytes of the status holding
+ * its header and the first of its data. The data goes to the pull file
+ * through the pull writer a buffer at a time, so the file is written while
+ * the next part is read. The block is acknowledged with the bytes taken,
+ * 0 if they couldn't be saved. Returns -1 if the link failed.
+ */
+static int pull_block(fb_session *s, pull_sink **pull, int r)
+{
+    transport *t = s->t;
+    unsigned char *status = s->status;
+    char size[9], ack[16];
+    unsigned dsize, got, left, n, fill;
+    unsigned char *buf;
+    int saved = 0;
+    int len;
+
+    if (r < 12)
+        goto reply;
+    memcpy(size, status + 4, 8);
+    size[8] = 0;
+    dsize = strtoul(size, 0, 16);
+    got = r - 12;
+    if (dsize == 0 || got > dsize)
+        goto reply;
+
+    if (*pull == 0 && s->pull_fd >= 0)
+        *pull = pull_start(s->pull_fd);
+    if (*pull == 0) {
+        /* nowhere to put it, it still has to come off the link */
+        if (pull_drain(s, dsize - got))
+            return -1;
+        goto reply;
+    }
+
+    saved = 1;
+    buf = pull_buffer(*pull);
+    memcpy(buf, status + 12, got);
+    fill = got;
+
+    for (left = dsize - got; left > 0; left -= len) {
+        if (fill == PULL_BUFFER_SIZE) {
+            if (pull_commit(*pull, fill))
+                saved = 0;
+            buf = pull_buffer(*pull);
+            fill = 0;
+        }
+
+        n = PULL_BUFFER_SIZE - fill;
+        if (n > left) n = left;
+        len = transport_read(t, buf + fill, n, PAYLOAD_TIMEOUT(n), 0);
+        if (len <= 0) {
+            sprintf(s->error, "pull read failed (%s)",
+                    len < 0 ? strerror(errno) : "no data");
+            return -1;
+        }
+        fill += len;
     }
+    if (pull_commit(*pull, fill))
+        saved = 0;
 
+reply:
+    snprintf(ack, sizeof(ack), "FILE%08x", saved ? dsize : 0);
+    if (transport_write_message(t, ack, 12, COMMAND_TIMEOUT, 0) != 12) {
+        sprintf(s->error, "pull ack failed (%s)", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-static int check_response(usb_handle *usb, unsigned size, 
-                          unsigned data_okay, char *response)
+static int check_status(fb_session *s, unsigned size, unsigned data_okay,
+                        char *response, pull_sink **pull)
 {
-    /* FIXME: not clear why 64 doesn't work */
-#define SIZE 512
-    unsigned char status[SIZE + 1];
+    unsigned char *status = s->status;
     int r;
 
     for(;;) {
-        r = usb_read(usb, status, SIZE);
+        r = transport_read(s->t, status, FB_STATUS_SZ, STATUS_TIMEOUT, 0);
         if(r < 0) {
-            sprintf(ERROR, "status read failed (%s)", strerror(errno));
-            usb_close(usb);
+            sprintf(s->error, "status read failed (%s)", strerror(errno));
+            drop_link(s);
             return -1;
         }
         status[r] = 0;
 
         if(r < 4) {
-            sprintf(ERROR, "status malformed (%d bytes)", r);
-            usb_close(usb);
+            sprintf(s->error, "status malformed (%d bytes)", r);
+            drop_link(s);
             return -1;
         }
 
         if(!memcmp(status, "INFO", 4)) {
-            printf("%s", status + 4);
+            if(s->info) {
+                s->info(s->info_cookie, (char*) status + 4);
+            } else {
+                printf("%s", status + 4);
+            }
             continue;
         }
 
         if(!memcmp(status, "OKAY", 4)) {
             if(response) {
-                strcpy(response, (char*) status + 4);
+                snprintf(response, FB_RESPONSE_SZ + 1, "%s",
+                         (char*) status + 4);
             }
             return 0;
         }
 
         if(!memcmp(status, "FAIL", 4)) {
             if(r > 4) {
-                sprintf(ERROR, "remote: %s", status + 4);
+                snprintf(s->error, sizeof(s->error), "remote: %s",
+                         status + 4);
             } else {
-                strcpy(ERROR, "remote failure");
+                strcpy(s->error, "remote failure");
             }
             return -1;
         }
@@ -103,140 +205,193 @@ static int check_response(usb_handle *usb, unsigned size,
         if(!memcmp(status, "DATA", 4) && data_okay){
             unsigned dsize = strtoul((char*) status + 4, 0, 16);
             if(dsize > size) {
-                strcpy(ERROR, "data size too large");
-                usb_close(usb);
+                strcpy(s->error, "data size too large");
+                drop_link(s);
                 return -1;
             }
             return dsize;
         }
 
         if (!memcmp(status, "FILE", 4)) {
-            char size[9];
-            unsigned dsize;
-            unsigned left;
-            void *data;
-            char response[64];
-
-            if (snprintf(size, sizeof(size), "%s", (char *)status + 4) < 0)
-                goto err;
-            size[8] = 0;
-
-            dsize = strtoul(size, 0, 16);
-            if (dsize <= 0)
-                goto err;
-
-            if (dsize == r - 12) {
-                /* already read in status */
-                if (save_to_file(fd_pull, status + 12, r - 12))
-                    goto err;
-            } else {
-                left = dsize - (r - 12);
-                data = malloc(dsize);
-                if (!data)
-                    goto err;
-
-                memcpy(data, status + 12, r - 12);
-                if (usb_read(usb, data + r - 12, dsize) != left)
-                    goto err;
-
-                if (save_to_file(fd_pull, data, dsize))
-                    goto err;
+            if (pull_block(s, pull, r)) {
+                drop_link(s);
+                return -1;
             }
-
-            /* send bytes written */
-            snprintf(response, sizeof(response), "FILE%08x", dsize);
-            if (usb_write(usb, response, 12) != 12)
-                goto usb_err;
-
             continue;
-err:
-            snprintf(response, sizeof(response), "FILE%08x", 0);
-            if (usb_write(usb, response, 12) == 12)
-                continue;
-usb_err:
-            usb_close(usb);
-            return -1;
         }
 
-        strcpy(ERROR,"unknown status code");
-        usb_close(usb);
+        strcpy(s->error, "unknown status code");
+        drop_link(s);
         break;
     }
 
     return -1;
 }
 
-static int _command_send(usb_handle *usb, const char *cmd,
-                         const void *data, unsigned size,
-                         char *response)
+static int check_response(fb_session *s, unsigned size,
+                          unsigned data_okay, char *response)
+{
+    pull_sink *pull = 0;
+    int r;
+
+    r = check_status(s, size, data_okay, response, &pull);
+    if (pull && pull_finish(pull, r >= 0) && r >= 0) {
+        sprintf(s->error, "writing pulled data failed (%s)", strerror(errno));
+        r = -1;
+    }
+    return r;
+}
+
+/* a fill that hashes what it produced, in the transfer buffer it was
+ * produced into, so the data is not read once more */
+struct hash_fill
+{
+    fb_session *s;
+    transport_fill_func fill;
+    void *cookie;
+};
+
+static int hash_fill(void *cookie, void *buf, int len)
+{
+    struct hash_fill *h = cookie;
+    int r;
+
+    r = h->fill(h->cookie, buf, len);
+    if (r > 0)
+        h->s->crc = fb_crc32(h->s->crc, buf, r);
+    return r;
+}
+
+/* a source that hashes each piece as it is lent out */
+struct hash_source
+{
+    fb_session *s;
+    const transport_source *src;
+};
+
+static int hash_next(void *cookie, const void **buf, int len, int wait)
+{
+    struct hash_source *h = cookie;
+    int r;
+
+    r = h->src->next(h->src->cookie, buf, len, wait);
+    if (r > 0)
+        h->s->crc = fb_crc32(h->s->crc, *buf, r);
+    return r;
+}
+
+static void hash_release(void *cookie, int len)
+{
+    struct hash_source *h = cookie;
+
+    h->src->release(h->src->cookie, len);
+}
+
+static int _command_send(fb_session *s, const char *cmd,
+                         const void *data, transport_fill_func fill,
+                         void *cookie, const transport_source *src,
+                         unsigned size, char *response)
 {
+    transport *t = s->t;
+    struct hash_fill hash;
+    struct hash_source hsrc;
+    transport_source hashed;
     int cmdsize = strlen(cmd);
+    int done = 0;
     int r;
     
+    s->link_failed = 0;
+    s->in_data = 0;
     if(response) {
         response[0] = 0;
     }
 
-    if(cmdsize > 64) {
-        sprintf(ERROR,"command too large");
+    if(cmdsize > FB_COMMAND_SZ) {
+        sprintf(s->error, "command too large");
         return -1;
     }
 
-    if(usb_write(usb, cmd, cmdsize) != cmdsize) {
-        sprintf(ERROR,"command write failed (%s)", strerror(errno));
-        usb_close(usb);
+    if(transport_write_message(t, cmd, cmdsize, COMMAND_TIMEOUT, 0) != cmdsize) {
+        sprintf(s->error, "command write failed (%s)", strerror(errno));
+        drop_link(s);
         return -1;
     }
 
-    if(data == 0) {
-        return check_response(usb, size, 0, response);
+    if(data == 0 && fill == 0 && src == 0) {
+        return check_response(s, size, 0, response);
     }
 
-    r = check_response(usb, size, 1, 0);
+    r = check_response(s, size, 1, 0);
     if(r < 0) {
         return -1;
     }
     size = r;
+    s->in_data = 1;
+
+    /* hashing goes where the data is produced or lent out, or over the
+     * buffer, it never changes how the payload is written */
+    if(size && s->hash && fill) {
+        hash.s = s;
+        hash.fill = fill;
+        hash.cookie = cookie;
+        fill = hash_fill;
+        cookie = &hash;
+    } else if(size && s->hash && src) {
+        hsrc.s = s;
+        hsrc.src = src;
+        hashed.next = hash_next;
+        hashed.release = hash_release;
+        hashed.cookie = &hsrc;
+        src = &hashed;
+    } else if(size && s->hash) {
+        s->crc = fb_crc32(s->crc, data, size);
+    }
 
     if(size) {
-        r = usb_write(usb, data, size);
+        if(src) {
+            r = transport_write_next(t, src, size,
+                                     PAYLOAD_TIMEOUT(size), &done);
+        } else if(fill) {
+            r = transport_write_fill(t, fill, cookie, size,
+                                     PAYLOAD_TIMEOUT(size), &done);
+        } else {
+            r = transport_write(t, data, size,
+                                PAYLOAD_TIMEOUT(size), &done);
+        }
         if(r < 0) {
-            sprintf(ERROR, "data transfer failure (%s)", strerror(errno));
-            usb_close(usb);
+            sprintf(s->error, "data transfer failure (%s, %d of %u bytes sent)",
+                    strerror(errno), done, size);
+            drop_link(s);
             return -1;
         }
         if(r != ((int) size)) {
-            sprintf(ERROR, "data transfer failure (short transfer)");
-            usb_close(usb);
+            sprintf(s->error, "data transfer failure (short transfer)");
+            drop_link(s);
             return -1;
         }
     }
     
-    r = check_response(usb, 0, 0, 0);
+    r = check_response(s, 0, 0, 0);
     if(r < 0) {
         return -1;
     } else {
+        s->in_data = 0;
         return size;
     }
 }
 
-int fb_command(usb_handle *usb, const char *cmd)
-{
-    return _command_send(usb, cmd, 0, 0, 0);
-}
-
-int fb_command_response(usb_handle *usb, const char *cmd, char *response)
+int fb_session_command(fb_session *s, const char *cmd, char *response)
 {
-    return _command_send(usb, cmd, 0, 0, response);
+    return _command_send(s, cmd, 0, 0, 0, 0, 0, response);
 }
 
-int fb_download_data(usb_handle *usb, const void *data, unsigned size)
+int fb_session_download(fb_session *s, const void *data, unsigned size)
 {
     char cmd[64];
     int r;
     
     sprintf(cmd, "download:%08x", size);
-    r = _command_send(usb, cmd, data, size, 0);
+    r = _command_send(s, cmd, data, 0, 0, 0, size, 0);
     
     if(r < 0) {
         return -1;
@@ -245,14 +400,99 @@ int fb_download_data(usb_handle *usb, const void *data, unsigned size)
     }
 }
 
-int fb_stream_flash(usb_handle *usb, const char *cmd,
+int fb_session_download_part(fb_session *s, const void *data, unsigned size,
+        unsigned offset)
+{
+    char cmd[64];
+    int r;
+
+    sprintf(cmd, "download:%08x:%x", size, offset);
+    r = _command_send(s, cmd, data, 0, 0, 0, size, 0);
+    if(r < 0) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+int fb_session_stream_flash(fb_session *s, const char *cmd,
         const void *data, unsigned size)
 {
     int r;
-    r = _command_send(usb, cmd, data, size, 0);
+    r = _command_send(s, cmd, data, 0, 0, 0, size, 0);
+    if (r < 0) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+int fb_session_stream_flash_fill(fb_session *s, const char *cmd,
+        transport_fill_func fill, void *cookie, unsigned size)
+{
+    int r;
+    r = _command_send(s, cmd, 0, fill, cookie, 0, size, 0);
+    if (r < 0) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+int fb_session_stream_flash_next(fb_session *s, const char *cmd,
+        const transport_source *src, unsigned size)
+{
+    int r;
+    r = _command_send(s, cmd, 0, 0, 0, src, size, 0);
     if (r < 0) {
         return -1;
     } else {
         return 0;
     }
 }
+
+/* the default session on @t, INFO to stdout and pulls to fd_pull */
+static fb_session *session_of(transport *t)
+{
+    DEFAULT.t = t;
+    DEFAULT.pull_fd = fd_pull;
+    return &DEFAULT;
+}
+
+char *fb_get_error(void)
+{
+    return DEFAULT.error;
+}
+
+int fb_link_failed(void)
+{
+    return DEFAULT.link_failed;
+}
+
+int fb_command(transport *t, const char *cmd)
+{
+    return fb_session_command(session_of(t), cmd, 0);
+}
+
+int fb_command_response(transport *t, const char *cmd, char *response)
+{
+    return fb_session_command(session_of(t), cmd, response);
+}
+
+int fb_download_data(transport *t, const void *data, unsigned size)
+{
+    return fb_session_download(session_of(t), data, size);
+}
+
+int fb_stream_flash(transport *t, const char *cmd,
+        const void *data, unsigned size)
+{
+    return fb_session_stream_flash(session_of(t), cmd, data, size);
+}
+
+int fb_stream_flash_fill(transport *t, const char *cmd,
+        transport_fill_func fill, void *cookie, unsigned size)
+{
+    return fb_session_stream_flash_fill(session_of(t), cmd, fill, cookie,
+                                        size);
+}
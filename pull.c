@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fastboot.h"
+
+/*
+ * Writer for data pulled from the device. Two buffers take turns: one is
+ * written to the file on a thread of its own while the next is read from
+ * the device, so memory stays at two buffers whatever is pulled.
+ */
+
+#define PULL_BUFFERS 2
+
+struct pull_sink
+{
+    int fd;
+
+    unsigned char *buf[PULL_BUFFERS];
+    unsigned len[PULL_BUFFERS];
+    /* buffers handed to the writer / written so far */
+    unsigned queued;
+    unsigned written;
+    int done;           /* no more buffers will come */
+    int error;          /* errno of a failed write, sticky */
+
+    unsigned long long bytes;
+    double start;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+};
+
+static int write_all(int fd, const unsigned char *p, unsigned len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    pull_sink *p = arg;
+    unsigned i;
+    int error;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->written == p->queued && !p->done)
+            pthread_cond_wait(&p->wake, &p->lock);
+        if (p->written == p->queued)
+            break;
+        i = p->written % PULL_BUFFERS;
+        pthread_mutex_unlock(&p->lock);
+
+        /* after a failure the rest is only drained */
+        error = p->error ? 0 : write_all(p->fd, p->buf[i], p->len[i]);
+        if (error)
+            error = errno ? errno : EIO;
+
+        pthread_mutex_lock(&p->lock);
+        if (error)
+            p->error = error;
+        p->written++;
+        pthread_cond_broadcast(&p->wake);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+pull_sink *pull_start(int fd)
+{
+    pull_sink *p;
+    int i;
+
+    p = calloc(1, sizeof(pull_sink));
+    if (p == 0) return 0;
+
+    p->fd = fd;
+    for (i = 0; i < PULL_BUFFERS; i++) {
+        p->buf[i] = malloc(PULL_BUFFER_SIZE);
+        if (p->buf[i] == 0) goto fail;
+    }
+
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->wake, 0);
+    if (pthread_create(&p->thread, 0, writer, p)) {
+        pthread_cond_destroy(&p->wake);
+        pthread_mutex_destroy(&p->lock);
+        goto fail;
+    }
+    p->start = now();
+    return p;
+
+fail:
+    for (i = 0; i < PULL_BUFFERS; i++)
+        free(p->buf[i]);
+    free(p);
+    return 0;
+}
+
+void *pull_buffer(pull_sink *p)
+{
+    void *buf;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->queued - p->written == PULL_BUFFERS)
+        pthread_cond_wait(&p->wake, &p->lock);
+    buf = p->buf[p->queued % PULL_BUFFERS];
+    pthread_mutex_unlock(&p->lock);
+    return buf;
+}
+
+int pull_commit(pull_sink *p, unsigned len)
+{
+    int error;
+
+    pthread_mutex_lock(&p->lock);
+    if (len > 0) {
+        p->len[p->queued % PULL_BUFFERS] = len;
+        p->queued++;
+        p->bytes += len;
+        pthread_cond_broadcast(&p->wake);
+    }
+    error = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int pull_finish(pull_sink *p, int report)
+{
+    double elapsed;
+    int error;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, 0);
+
+    error = p->error;
+    elapsed = now() - p->start;
+    if (report && !error && p->bytes)
+        fprintf(stderr, "pulled %llu KB in %.3fs (%.1f MB/s)\n",
+                p->bytes / 1024, elapsed,
+                elapsed > 0 ? p->bytes / elapsed / (1024 * 1024) : 0);
+
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    for (i = 0; i < PULL_BUFFERS; i++)
+        free(p->buf[i]);
+    free(p);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fastboot.h"
+
+/*
+ * Single producer, single consumer ring of fixed chunks between the image
+ * pipeline (reading, inflating) running on its own thread and the thread
+ * doing the transfers. The chunks are allocated once and recycled; head
+ * and tail are only ever written by one side each, so the fast path takes
+ * no lock. The mutex and condition are only for a side that has to sleep.
+ *
+ * The consumer sends straight out of the chunks, which come from the
+ * transport where it has memory it sends in place (usbfs mappings), so
+ * the payload is produced right where the controller reads it. A chunk
+ * is only recycled once the transport released all of it, so transfers
+ * can stay queued across chunk boundaries.
+ */
+
+#define RING_SLOTS  4
+#define RING_CHUNK  (1024 * 1024)
+
+struct chunk_ring
+{
+    transport *t;
+    transport_fill_func fill;
+    void *cookie;
+    unsigned long long total;
+
+    unsigned char *slot[RING_SLOTS];
+    unsigned char slot_mapped[RING_SLOTS];
+    unsigned len[RING_SLOTS];
+
+    /* chunks produced / released so far, written by one side each */
+    unsigned head;
+    unsigned tail;
+    /* consumer only: the chunk being lent out and the position in it,
+     * and the bytes of chunk tail released so far; the chunks between
+     * tail and lend are out with the transport */
+    unsigned lend;
+    unsigned offset;
+    unsigned freed;
+
+    int error;      /* errno of a failed fill, set by the producer */
+    int stop;       /* consumer is gone, set by ring_finish */
+
+    int waiting;    /* sides sleeping on wake */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+};
+
+static unsigned load(unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void store(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static void wake_other(chunk_ring *r)
+{
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* sleep until @ready(r) holds; the other side calls wake_other after it
+ * changed what @ready looks at */
+static void wait_for(chunk_ring *r, int (*ready)(chunk_ring *r))
+{
+    if (ready(r))
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    while (!ready(r))
+        pthread_cond_wait(&r->wake, &r->lock);
+    __atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int has_space(chunk_ring *r)
+{
+    return load(&r->head) - load(&r->tail) < RING_SLOTS ||
+           __atomic_load_n(&r->stop, __ATOMIC_SEQ_CST);
+}
+
+static int has_data(chunk_ring *r)
+{
+    return load(&r->head) != r->lend ||
+           __atomic_load_n(&r->error, __ATOMIC_SEQ_CST);
+}
+
+static void *producer(void *arg)
+{
+    chunk_ring *r = arg;
+    unsigned long long done = 0;
+
+    while (done < r->total) {
+        unsigned head = load(&r->head);
+        unsigned i = head % RING_SLOTS;
+        unsigned n = RING_CHUNK;
+
+        if (n > r->total - done) n = r->total - done;
+
+        wait_for(r, has_space);
+        if (__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST))
+            break;
+
+        errno = 0;
+        if (r->fill(r->cookie, r->slot[i], n) != (int) n) {
+            __atomic_store_n(&r->error, errno ? errno : EIO, __ATOMIC_SEQ_CST);
+            wake_other(r);
+            break;
+        }
+        r->len[i] = n;
+        done += n;
+
+        store(&r->head, head + 1);
+        wake_other(r);
+    }
+    return 0;
+}
+
+int ring_next(void *cookie, const void **buf, int len, int wait)
+{
+    chunk_ring *r = cookie;
+    unsigned i = r->lend % RING_SLOTS;
+    unsigned n;
+
+    if (!wait && !has_data(r))
+        return 0;
+    wait_for(r, has_data);
+    if (load(&r->head) == r->lend) {
+        /* only an error wakes us without data */
+        errno = r->error;
+        return -1;
+    }
+
+    /* pieces never span chunks, so each is released within one */
+    n = r->len[i] - r->offset;
+    if (n > (unsigned) len) n = len;
+    *buf = r->slot[i] + r->offset;
+    r->offset += n;
+    if (r->offset == r->len[i]) {
+        r->offset = 0;
+        r->lend++;
+    }
+    return n;
+}
+
+void ring_release(void *cookie, int len)
+{
+    chunk_ring *r = cookie;
+    unsigned tail = load(&r->tail);
+
+    /* a chunk all sent goes back to the producer */
+    r->freed += len;
+    if (r->freed == r->len[tail % RING_SLOTS]) {
+        r->freed = 0;
+        store(&r->tail, tail + 1);
+        wake_other(r);
+    }
+}
+
+static void free_slots(chunk_ring *r)
+{
+    int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        if (r->slot_mapped[i])
+            transport_buf_free(r->t, r->slot[i], RING_CHUNK);
+        else
+            free(r->slot[i]);
+    }
+}
+
+chunk_ring *ring_start(transport *t, transport_fill_func fill, void *cookie,
+                       unsigned long long total)
+{
+    chunk_ring *r;
+    int i;
+
+    r = calloc(1, sizeof(chunk_ring));
+    if (r == 0) return 0;
+
+    r->t = t;
+    r->fill = fill;
+    r->cookie = cookie;
+    r->total = total;
+    for (i = 0; i < RING_SLOTS; i++) {
+        r->slot[i] = transport_buf_alloc(t, RING_CHUNK);
+        if (r->slot[i]) {
+            r->slot_mapped[i] = 1;
+            continue;
+        }
+        r->slot[i] = malloc(RING_CHUNK);
+        if (r->slot[i] == 0) goto fail;
+    }
+
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->wake, 0);
+    if (pthread_create(&r->thread, 0, producer, r)) {
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->lock);
+        goto fail;
+    }
+    return r;
+
+fail:
+    free_slots(r);
+    free(r);
+    return 0;
+}
+
+void ring_finish(chunk_ring *r)
+{
+    /* the consumer may have given up early, let the producer go */
+    __atomic_store_n(&r->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, 0);
+
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free_slots(r);
+    free(r);
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# End-to-end check against the built-in device simulator, run by
+# "make check": flashes an image with the crc check, in one data phase,
+# in segments and from a forked device, and pulls a file back. Fails on
+# any mismatch; the timings printed double as a quick benchmark.
+
+PREKIT=${PREKIT:-./prekit}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    cat "$tmp/log" >&2
+    exit 1
+}
+
+# flash <sim settings> <label>: flash the image, the device's crc must match
+flash() {
+    "$PREKIT" -S "$1" -c getvar:crc32: flash system "$tmp/system.img" \
+        > "$tmp/log" 2>&1 || fail "flash ($2)"
+    grep -q "matches device" "$tmp/log" || fail "flash ($2): crc not checked"
+    echo "flash $2: $(grep "total time" "$tmp/log")"
+}
+
+# 6MB of random data, over the ring threshold and over maxdl below
+head -c 6291456 /dev/urandom > "$tmp/system.img" || exit 1
+
+flash "" "one phase"
+flash "maxdl=1048576" "segments"
+flash "fork,link=40,write=20" "forked, 40MB/s link"
+
+# the simulator pulls bytes 0..255 over and over
+i=0
+while [ $i -lt 256 ]; do
+    printf "\\$(printf %o $i)"
+    i=$((i + 1))
+done > "$tmp/pattern"
+i=0
+while [ $i -lt 11 ]; do
+    cat "$tmp/pattern" "$tmp/pattern" > "$tmp/double"
+    mv "$tmp/double" "$tmp/pattern"
+    i=$((i + 1))
+done
+head -c 300000 "$tmp/pattern" > "$tmp/expected"
+
+"$PREKIT" -S "pull=300000" oem pull x "$tmp/pulled" > "$tmp/log" 2>&1 ||
+    fail "pull"
+cmp -s "$tmp/expected" "$tmp/pulled" || fail "pulled data differs"
+echo "pull: $(grep "total time" "$tmp/log")"
+
+exit 0
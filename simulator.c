@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "fastboot.h"
+
+#ifdef _WIN32
+int sim_parse(const char *spec, sim_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    return 0;
+}
+
+transport *sim_open(const sim_config *cfg)
+{
+    errno = ENOSYS;
+    return 0;
+}
+#else
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * A fastboot device that lives at the other end of a socketpair, in a
+ * thread or a child process, speaking the TCP framing of tcp.c. Commands,
+ * the link and the flash storage are delayed as configured, so the host
+ * pipeline can be timed without hardware.
+ */
+
+#define SIM_CHUNK       (64 * 1024)
+#define SIM_PULL_BLOCK  (64 * 1024)
+/* bytes of a FILE block sent along with its header, like a 512 byte read */
+#define SIM_FILE_HEAD   500
+
+#define SIM_DEFAULT_MAX_DOWNLOAD (512 * 1024 * 1024)
+#define SIM_DEFAULT_PULL         (1024 * 1024)
+
+typedef struct sim_device sim_device;
+
+struct sim_device
+{
+    int fd;
+    sim_config cfg;
+
+    /* size of the last download, flashed by a later flash:<ptn> */
+    unsigned downloaded;
+    /* where the next segment of a segmented flash has to start */
+    unsigned long long next_offset;
+    /* CRC32 of the data received since the last download or first
+     * segment, and of the last partition written, for getvar:crc32:<ptn> */
+    unsigned long crc;
+    char flashed[64];
+    unsigned long flashed_crc;
+    unsigned char buf[SIM_CHUNK];
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t)
+{
+    struct timespec ts;
+    long long d = t - now_ns();
+
+    if(d <= 0) return;
+    ts.tv_sec = d / 1000000000LL;
+    ts.tv_nsec = d % 1000000000LL;
+    while(nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/* time @bytes take at @bps, 0 if unlimited */
+static long long xfer_ns(unsigned long long bytes, unsigned long long bps)
+{
+    return bps ? bytes * 1000000000ULL / bps : 0;
+}
+
+static int io_all(int fd, void *buf, unsigned len, int out)
+{
+    unsigned char *p = buf;
+    ssize_t n;
+
+    while(len > 0) {
+        if(out)
+            n = send(fd, p, len, MSG_NOSIGNAL);
+        else
+            n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_header(sim_device *d, unsigned long long *len)
+{
+    unsigned char hdr[8];
+    int i;
+
+    if(io_all(d->fd, hdr, sizeof(hdr), 0))
+        return -1;
+    *len = 0;
+    for(i = 0; i < 8; i++)
+        *len = (*len << 8) | hdr[i];
+    return 0;
+}
+
+static int send_msg(sim_device *d, const void *data, unsigned len)
+{
+    unsigned char hdr[8];
+    unsigned long long v = len;
+    int i;
+
+    for(i = 7; i >= 0; i--) {
+        hdr[i] = v & 0xff;
+        v >>= 8;
+    }
+    if(io_all(d->fd, hdr, sizeof(hdr), 1))
+        return -1;
+    return io_all(d->fd, (void*) data, len, 1);
+}
+
+static int reply(sim_device *d, const char *fmt, ...)
+{
+    char msg[FB_RESPONSE_SZ + 4 + 1];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if(n >= (int) sizeof(msg)) n = sizeof(msg) - 1;
+    return send_msg(d, msg, n);
+}
+
+/* take a data phase of @size bytes at link speed */
+static int recv_data(sim_device *d, unsigned size)
+{
+    unsigned long long len = 0;
+    unsigned got = 0;
+    long long start;
+
+    if(reply(d, "DATA%08x", size))
+        return -1;
+    if(size == 0)
+        return 0;
+
+    /* like a device, take the data in as many messages as it comes */
+    start = now_ns();
+    while(got < size) {
+        unsigned n;
+
+        if(len == 0) {
+            if(recv_header(d, &len))
+                return -1;
+            if(len == 0 || len > size - got) {
+                fprintf(stderr, "sim: %u data bytes left, got a %llu byte "
+                        "message\n", size - got, len);
+                return -1;
+            }
+        }
+        n = len > SIM_CHUNK ? SIM_CHUNK : len;
+        len -= n;
+        if(io_all(d->fd, d->buf, n, 0))
+            return -1;
+        d->crc = crc32(d->crc, d->buf, n);
+        got += n;
+        sleep_until(start + xfer_ns(got, d->cfg.link_bps));
+    }
+    return 0;
+}
+
+static int write_storage(sim_device *d, const char *ptn, unsigned size)
+{
+    if(reply(d, "INFOwriting '%s'", ptn))
+        return -1;
+    sleep_until(now_ns() + xfer_ns(size, d->cfg.write_bps));
+    return 0;
+}
+
+static const char *getvar(sim_device *d, const char *name, char *buf, int size)
+{
+    if(!strcmp(name, "version")) return "0.4";
+    if(!strcmp(name, "product")) return "simulator";
+    if(!strcmp(name, "serialno")) return "sim0";
+    if(!strcmp(name, "ifwi")) return "1.0";
+    if(!strcmp(name, "preos")) return "1.0";
+    if(!strcmp(name, "segments") && !d->cfg.no_segments) return "yes";
+    if(!strcmp(name, "max-download-size")) {
+        snprintf(buf, size, "0x%08x", d->cfg.max_download);
+        return buf;
+    }
+    if(!strncmp(name, "crc32:", 6) && d->flashed[0] &&
+       !strcmp(name + 6, d->flashed)) {
+        snprintf(buf, size, "0x%08lx", d->flashed_crc);
+        return buf;
+    }
+    return 0;
+}
+
+static int do_getvar(sim_device *d, const char *name)
+{
+    static const char *all[] = { "version", "product", "serialno", "ifwi",
+                                 "preos", "max-download-size", "segments" };
+    char buf[32];
+    const char *v;
+    unsigned i;
+
+    if(!strcmp(name, "all")) {
+        for(i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+            v = getvar(d, all[i], buf, sizeof(buf));
+            if(v && reply(d, "INFO%s: %s", all[i], v))
+                return -1;
+        }
+        return reply(d, "OKAY");
+    }
+
+    v = getvar(d, name, buf, sizeof(buf));
+    if(v == 0)
+        return reply(d, "FAILunknown variable");
+    return reply(d, "OKAY%s", v);
+}
+
+/* send cfg.pull_size bytes as FILE blocks, each acknowledged by the host */
+static int do_pull(sim_device *d)
+{
+    unsigned char msg[12 + SIM_FILE_HEAD];
+    unsigned long long len;
+    unsigned left = d->cfg.pull_size;
+    unsigned i;
+
+    for(i = 0; i < sizeof(d->buf); i++)
+        d->buf[i] = i;
+
+    while(left > 0) {
+        unsigned n = left > SIM_PULL_BLOCK ? SIM_PULL_BLOCK : left;
+        unsigned head = n > SIM_FILE_HEAD ? SIM_FILE_HEAD : n;
+        char ack[13];
+
+        snprintf((char*) msg, 13, "FILE%08x", n);
+        memcpy(msg + 12, d->buf, head);
+        if(send_msg(d, msg, 12 + head))
+            return -1;
+        if(n > head && send_msg(d, d->buf + head, n - head))
+            return -1;
+        sleep_until(now_ns() + xfer_ns(n, d->cfg.link_bps));
+
+        if(recv_header(d, &len) || len != 12 || io_all(d->fd, ack, 12, 0))
+            return -1;
+        ack[12] = 0;
+        if(strtoul(ack + 4, 0, 16) != n)
+            return reply(d, "FAILpull aborted by host");
+        left -= n;
+    }
+    return reply(d, "OKAY");
+}
+
+static int handle(sim_device *d, char *cmd)
+{
+    char *ptn, *arg;
+    unsigned size;
+    unsigned long long offset;
+
+    if(!strncmp(cmd, "getvar:", 7))
+        return do_getvar(d, cmd + 7);
+
+    if(!strncmp(cmd, "download:", 9)) {
+        /* download:<size>[:<offset>], parts of a large download are
+         * appended to what came before */
+        size = strtoul(cmd + 9, &arg, 16);
+        offset = 0;
+        if(*arg == ':') {
+            if(d->cfg.no_segments)
+                return reply(d, "FAILunknown download form");
+            offset = strtoull(arg + 1, 0, 16);
+            if(offset != 0 && offset != d->downloaded)
+                return reply(d, "FAILpart at 0x%llx, expected 0x%x",
+                             offset, d->downloaded);
+        }
+        if(size > d->cfg.max_download)
+            return reply(d, "FAILdata too large");
+        if(offset == 0)
+            d->crc = 0;
+        if(recv_data(d, size))
+            return -1;
+        d->downloaded = offset + size;
+        return reply(d, "OKAY");
+    }
+
+    if(!strncmp(cmd, "flash:", 6)) {
+        ptn = cmd + 6;
+        arg = strchr(ptn, ':');
+        if(arg) {
+            /* streaming flash:<ptn>:<size>[:<offset>], a payload over
+             * max-download-size comes as segments at increasing offsets */
+            *arg++ = 0;
+            size = strtoul(arg, &arg, 16);
+            if(size > d->cfg.max_download)
+                return reply(d, "FAILdata too large");
+            if(*arg == ':') {
+                if(d->cfg.no_segments)
+                    return reply(d, "FAILunknown flash form");
+                offset = strtoull(arg + 1, 0, 16);
+                if(offset != 0 && offset != d->next_offset)
+                    return reply(d, "FAILsegment at 0x%llx, expected 0x%llx",
+                                 offset, d->next_offset);
+                d->next_offset = offset + size;
+            }
+            if(*arg != ':' || offset == 0)
+                d->crc = 0;
+            if(recv_data(d, size))
+                return -1;
+        } else {
+            size = d->downloaded;
+            d->downloaded = 0;
+        }
+        if(write_storage(d, ptn, size))
+            return -1;
+        snprintf(d->flashed, sizeof(d->flashed), "%s", ptn);
+        d->flashed_crc = d->crc;
+        return reply(d, "OKAY");
+    }
+
+    if(!strncmp(cmd, "erase:", 6)) {
+        if(reply(d, "INFOerasing '%s'", cmd + 6))
+            return -1;
+        return reply(d, "OKAY");
+    }
+
+    if(!strncmp(cmd, "oem pull", 8))
+        return do_pull(d);
+
+    if(!strncmp(cmd, "oem ", 4) || !strcmp(cmd, "reboot") ||
+       !strcmp(cmd, "reboot-bootloader") || !strcmp(cmd, "continue"))
+        return reply(d, "OKAY");
+
+    return reply(d, "FAILunknown command");
+}
+
+static void serve(sim_device *d)
+{
+    char cmd[FB_COMMAND_SZ + 1];
+    unsigned long long len;
+
+    if(io_all(d->fd, cmd, 4, 0) || memcmp(cmd, "FB", 2) ||
+       io_all(d->fd, "FB01", 4, 1))
+        return;
+
+    for(;;) {
+        if(recv_header(d, &len))
+            return;
+        if(len > FB_COMMAND_SZ) {
+            fprintf(stderr, "sim: %llu byte command\n", len);
+            return;
+        }
+        if(io_all(d->fd, cmd, len, 0))
+            return;
+        cmd[len] = 0;
+
+        sleep_until(now_ns() + d->cfg.latency_us * 1000LL);
+        if(handle(d, cmd))
+            return;
+    }
+}
+
+static void *sim_thread(void *arg)
+{
+    sim_device *d = arg;
+
+    serve(d);
+    close(d->fd);
+    free(d);
+    return 0;
+}
+
+int sim_parse(const char *spec, sim_config *cfg)
+{
+    char *copy, *opt, *save = 0;
+    unsigned long val;
+    char *end;
+    int r = 0;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->max_download = SIM_DEFAULT_MAX_DOWNLOAD;
+    cfg->pull_size = SIM_DEFAULT_PULL;
+
+    copy = strdup(spec);
+    if(copy == 0) return -1;
+
+    for(opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(0, ",", &save)) {
+        char *eq = strchr(opt, '=');
+
+        if(!strcmp(opt, "fork")) {
+            cfg->process = 1;
+            continue;
+        }
+        if(!strcmp(opt, "noseg")) {
+            cfg->no_segments = 1;
+            continue;
+        }
+        if(!strcmp(opt, "default"))
+            continue;
+        if(eq == 0) { r = -1; break; }
+
+        *eq = 0;
+        val = strtoul(eq + 1, &end, 0);
+        if(*end) { r = -1; break; }
+
+        if(!strcmp(opt, "latency"))         /* us per command */
+            cfg->latency_us = val;
+        else if(!strcmp(opt, "link"))       /* MB/s, 0 unlimited */
+            cfg->link_bps = val * 1024ULL * 1024;
+        else if(!strcmp(opt, "write"))      /* MB/s, 0 instant */
+            cfg->write_bps = val * 1024ULL * 1024;
+        else if(!strcmp(opt, "maxdl"))      /* bytes */
+            cfg->max_download = val;
+        else if(!strcmp(opt, "pull"))       /* bytes */
+            cfg->pull_size = val;
+        else { r = -1; break; }
+    }
+
+    free(copy);
+    return r;
+}
+
+transport *sim_open(const sim_config *cfg)
+{
+    sim_device *d;
+    pthread_t thread;
+    pthread_attr_t attr;
+    int sv[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+        return 0;
+
+    d = calloc(1, sizeof(sim_device));
+    if(d == 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    d->fd = sv[1];
+    d->cfg = *cfg;
+
+    if(cfg->process) {
+        pid = fork();
+        if(pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            free(d);
+            return 0;
+        }
+        if(pid == 0) {
+            close(sv[0]);
+            serve(d);
+            _exit(0);
+        }
+        close(sv[1]);
+        free(d);
+    } else {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, sim_thread, d)) {
+            pthread_attr_destroy(&attr);
+            close(sv[0]);
+            close(sv[1]);
+            free(d);
+            errno = EAGAIN;
+            return 0;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return tcp_open_fd(sv[0]);
+}
+#endif
@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fastboot.h"
+
+#ifdef _WIN32
+transport *tcp_open_fd(int fd)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+transport *tcp_connect(const char *target)
+{
+    errno = ENOSYS;
+    return 0;
+}
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Fastboot over TCP. After a "FB<version>" handshake in both directions
+ * every message is sent as an 8 byte big-endian length followed by the
+ * payload, a read returns at most the rest of one message.
+ */
+
+#define TCP_DEFAULT_PORT    5554
+#define TCP_HANDSHAKE       "FB01"
+#define TCP_HANDSHAKE_LEN   4
+#define TCP_HANDSHAKE_MS    5000
+
+/* staging buffer of write_fill, and the socket buffers */
+#define TCP_FILL_SIZE       (1024 * 1024)
+#define TCP_SOCKBUF_SIZE    (4 * 1024 * 1024)
+
+typedef struct tcp_transport tcp_transport;
+
+struct tcp_transport
+{
+    /* must stay first */
+    transport t;
+
+    int fd;
+    /* readable once cancelled */
+    int cancel_fd;
+    /* payload bytes of the current incoming message not yet read */
+    unsigned long long left;
+    unsigned char *fill_buf;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wait until @fd is ready for @events, 0 on success */
+static int tcp_wait(tcp_transport *tt, short events, long long deadline)
+{
+    struct pollfd pfd[2];
+    int timeout, r;
+
+    for(;;) {
+        timeout = -1;
+        if(deadline) {
+            timeout = deadline - now_ms();
+            if(timeout <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        pfd[0].fd = tt->fd;
+        pfd[0].events = events;
+        pfd[1].fd = tt->cancel_fd;
+        pfd[1].events = POLLIN;
+        r = poll(pfd, 2, timeout);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        if(pfd[1].revents & POLLIN) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if(pfd[0].revents)
+            return 0;
+    }
+}
+
+/* move exactly @len bytes, *@done counts them */
+static int tcp_io(tcp_transport *tt, void *buf, int len, int out,
+                  long long deadline, int *done)
+{
+    unsigned char *p = buf;
+    int count = 0;
+    ssize_t n;
+
+    while(count < len) {
+        if(tcp_wait(tt, out ? POLLOUT : POLLIN, deadline))
+            return -1;
+
+        if(out)
+            n = send(tt->fd, p + count, len - count, MSG_NOSIGNAL);
+        else
+            n = recv(tt->fd, p + count, len - count, 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EINTR) continue;
+            return -1;
+        }
+        if(n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        count += n;
+        if(done) *done = count;
+    }
+    return count;
+}
+
+static void put_be64(unsigned char *p, unsigned long long v)
+{
+    int i;
+
+    for(i = 7; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static unsigned long long get_be64(const unsigned char *p)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static long long deadline_of(int timeout_ms)
+{
+    return timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+}
+
+static int tcp_read(transport *t, void *data, int len,
+                    int timeout_ms, int *done)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+    long long deadline = deadline_of(timeout_ms);
+    unsigned char hdr[8];
+    int n;
+
+    if(done) *done = 0;
+    if(tt->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if(tt->left == 0) {
+        if(tcp_io(tt, hdr, sizeof(hdr), 0, deadline, 0) < 0)
+            return -1;
+        tt->left = get_be64(hdr);
+    }
+
+    if((unsigned long long) len > tt->left)
+        len = tt->left;
+    n = tcp_io(tt, data, len, 0, deadline, done);
+    if(n < 0)
+        return -1;
+    tt->left -= n;
+    return n;
+}
+
+static int tcp_write(transport *t, const void *data, int len,
+                     int timeout_ms, int *done)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+    long long deadline = deadline_of(timeout_ms);
+    unsigned char hdr[8];
+
+    if(done) *done = 0;
+    if(tt->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    put_be64(hdr, len);
+    if(tcp_io(tt, hdr, sizeof(hdr), 1, deadline, 0) < 0)
+        return -1;
+    return tcp_io(tt, (void*) data, len, 1, deadline, done);
+}
+
+static int tcp_write_fill(transport *t, transport_fill_func fill,
+                          void *cookie, int len, int timeout_ms, int *done)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+    long long deadline = deadline_of(timeout_ms);
+    unsigned char hdr[8];
+    int count = 0;
+
+    if(done) *done = 0;
+    if(tt->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if(tt->fill_buf == 0) {
+        tt->fill_buf = malloc(TCP_FILL_SIZE);
+        if(tt->fill_buf == 0)
+            return -1;
+    }
+
+    /* one message for the whole payload, sent as it is produced */
+    put_be64(hdr, len);
+    if(tcp_io(tt, hdr, sizeof(hdr), 1, deadline, 0) < 0)
+        return -1;
+
+    while(count < len) {
+        int xfer = len - count;
+        int n = 0;
+
+        if(xfer > TCP_FILL_SIZE) xfer = TCP_FILL_SIZE;
+        if(fill(cookie, tt->fill_buf, xfer) != xfer) {
+            if(!errno) errno = EIO;
+            return -1;
+        }
+        if(tcp_io(tt, tt->fill_buf, xfer, 1, deadline, &n) < 0) {
+            if(done) *done = count + n;
+            return -1;
+        }
+        count += xfer;
+        if(done) *done = count;
+    }
+    return count;
+}
+
+static int tcp_write_next(transport *t, const transport_source *src,
+                          int len, int timeout_ms, int *done)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+    long long deadline = deadline_of(timeout_ms);
+    unsigned char hdr[8];
+    const void *buf;
+    int count = 0;
+
+    if(done) *done = 0;
+    if(tt->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    /* one message for the whole payload, each piece sent where it is */
+    put_be64(hdr, len);
+    if(tcp_io(tt, hdr, sizeof(hdr), 1, deadline, 0) < 0)
+        return -1;
+
+    while(count < len) {
+        int xfer = src->next(src->cookie, &buf, len - count, 1);
+        int n = 0;
+
+        if(xfer <= 0) {
+            if(xfer == 0) errno = EIO;
+            return -1;
+        }
+        if(tcp_io(tt, (void*) buf, xfer, 1, deadline, &n) < 0) {
+            if(done) *done = count + n;
+            return -1;
+        }
+        src->release(src->cookie, xfer);
+        count += xfer;
+        if(done) *done = count;
+    }
+    return count;
+}
+
+static int tcp_close(transport *t)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+
+    if(tt->fd >= 0)
+        close(tt->fd);
+    tt->fd = -1;
+    if(tt->cancel_fd >= 0)
+        close(tt->cancel_fd);
+    tt->cancel_fd = -1;
+    free(tt->fill_buf);
+    tt->fill_buf = 0;
+    return 0;
+}
+
+static void tcp_cancel(transport *t)
+{
+    tcp_transport *tt = (tcp_transport*) t;
+
+    eventfd_write(tt->cancel_fd, 1);
+}
+
+static const transport_ops tcp_ops = {
+    .name = "tcp",
+    .read = tcp_read,
+    .write = tcp_write,
+    .write_fill = tcp_write_fill,
+    .write_next = tcp_write_next,
+    .close = tcp_close,
+    .cancel = tcp_cancel,
+};
+
+static int handshake(tcp_transport *tt)
+{
+    long long deadline = now_ms() + TCP_HANDSHAKE_MS;
+    char buf[TCP_HANDSHAKE_LEN];
+
+    if(tcp_io(tt, TCP_HANDSHAKE, TCP_HANDSHAKE_LEN, 1, deadline, 0) < 0)
+        return -1;
+    if(tcp_io(tt, buf, TCP_HANDSHAKE_LEN, 0, deadline, 0) < 0)
+        return -1;
+    /* any version of ours is fine, the framing never changed */
+    if(memcmp(buf, "FB", 2)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+transport *tcp_open_fd(int fd)
+{
+    tcp_transport *tt;
+    int one = 1;
+    int errno_tmp;
+
+    tt = calloc(1, sizeof(tcp_transport));
+    if(tt == 0) {
+        close(fd);
+        return 0;
+    }
+    tt->t.ops = &tcp_ops;
+    tt->t.max_xfer = TCP_FILL_SIZE;
+    tt->fd = fd;
+
+    /* commands and status replies are tiny, never hold them back */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    tt->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(tt->cancel_fd < 0 || handshake(tt)) {
+        errno_tmp = errno;
+        if(tt->cancel_fd >= 0)
+            close(tt->cancel_fd);
+        close(fd);
+        free(tt);
+        errno = errno_tmp;
+        return 0;
+    }
+    return &tt->t;
+}
+
+transport *tcp_connect(const char *target)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port = 0;
+    char portbuf[16];
+    const char *colon;
+    int fd = -1, size = TCP_SOCKBUF_SIZE;
+    int r, errno_tmp;
+
+    /* host, host:port, [v6addr]:port */
+    if(target[0] == '[' && (colon = strchr(target, ']'))) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - target - 1), target + 1);
+        if(colon[1] == ':') port = colon + 2;
+    } else if((colon = strchr(target, ':')) && colon == strrchr(target, ':')) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - target), target);
+        port = colon + 1;
+    } else {
+        snprintf(host, sizeof(host), "%s", target);
+    }
+    if(port == 0 || *port == 0) {
+        snprintf(portbuf, sizeof(portbuf), "%d", TCP_DEFAULT_PORT);
+        port = portbuf;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    r = getaddrinfo(host, port, &hints, &res);
+    if(r) {
+        fprintf(stderr, "cannot resolve %s: %s\n", host, gai_strerror(r));
+        errno = EHOSTUNREACH;
+        return 0;
+    }
+
+    for(ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if(fd < 0) continue;
+
+        /* before connect, so the window scale covers the big buffers */
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        errno_tmp = errno;
+        close(fd);
+        errno = errno_tmp;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0)
+        return 0;
+
+    return tcp_open_fd(fd);
+}
+#endif
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fastboot.h"
+
+/*
+ * Wire trace of a session. A trace transport sits in front of the real
+ * one and appends a record per call:
+ *
+ *   u64 start     ns since the transport was opened
+ *   u64 duration  ns spent in the call
+ *   u8  op        TRACE_*
+ *   u8  reserved
+ *   u16 saved     payload bytes stored after the record
+ *   i32 result    bytes moved, or -errno
+ *   u32 length    bytes asked for
+ *
+ * all little-endian, behind a "FBTR" + u32 version file header. Commands
+ * and responses are small and are stored in full, data phases only as
+ * byte counts.
+ */
+
+#define TRACE_MAGIC     "FBTR"
+#define TRACE_VERSION   1
+#define TRACE_RECORD    28
+/* longer transfers are data, only their size is kept */
+#define TRACE_SAVE_MAX  512
+
+#define TRACE_READ      1
+#define TRACE_WRITE     2
+#define TRACE_FILL      3
+#define TRACE_CLOSE     4
+#define TRACE_MESSAGE   5
+
+typedef struct trace_transport trace_transport;
+
+struct trace_transport
+{
+    /* must stay first */
+    transport t;
+
+    transport *inner;
+    FILE *f;
+    long long start;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put_le(unsigned char *p, unsigned long long v, int n)
+{
+    while(n-- > 0) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static unsigned long long get_le(const unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+
+    while(n-- > 0)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+static void record(trace_transport *tt, int op, long long start,
+                   int result, int len, const void *data)
+{
+    unsigned char rec[TRACE_RECORD];
+    int saved = 0;
+
+    if(data && result > 0 && result <= TRACE_SAVE_MAX)
+        saved = result;
+
+    put_le(rec, start - tt->start, 8);
+    put_le(rec + 8, now_ns() - start, 8);
+    rec[16] = op;
+    rec[17] = 0;
+    put_le(rec + 18, saved, 2);
+    put_le(rec + 20, result < 0 ? -errno : result, 4);
+    put_le(rec + 24, len, 4);
+
+    fwrite(rec, sizeof(rec), 1, tt->f);
+    if(saved)
+        fwrite(data, saved, 1, tt->f);
+}
+
+static int trace_read(transport *t, void *data, int len,
+                      int timeout_ms, int *done)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r, errno_tmp;
+
+    r = transport_read(tt->inner, data, len, timeout_ms, done);
+    errno_tmp = errno;
+    record(tt, TRACE_READ, start, r, len, data);
+    errno = errno_tmp;
+    return r;
+}
+
+static int trace_write(transport *t, const void *data, int len,
+                       int timeout_ms, int *done)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r, errno_tmp;
+
+    r = transport_write(tt->inner, data, len, timeout_ms, done);
+    errno_tmp = errno;
+    record(tt, TRACE_WRITE, start, r, len, data);
+    errno = errno_tmp;
+    return r;
+}
+
+static int trace_write_message(transport *t, const void *data, int len,
+                               int timeout_ms, int *done)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r, errno_tmp;
+
+    r = transport_write_message(tt->inner, data, len, timeout_ms, done);
+    errno_tmp = errno;
+    record(tt, TRACE_MESSAGE, start, r, len, data);
+    errno = errno_tmp;
+    return r;
+}
+
+static int trace_write_fill(transport *t, transport_fill_func fill,
+                            void *cookie, int len, int timeout_ms, int *done)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r, errno_tmp;
+
+    r = transport_write_fill(tt->inner, fill, cookie, len, timeout_ms, done);
+    errno_tmp = errno;
+    record(tt, TRACE_FILL, start, r, len, 0);
+    errno = errno_tmp;
+    return r;
+}
+
+/* like a fill, the data isn't kept */
+static int trace_write_next(transport *t, const transport_source *src,
+                            int len, int timeout_ms, int *done)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r, errno_tmp;
+
+    r = transport_write_next(tt->inner, src, len, timeout_ms, done);
+    errno_tmp = errno;
+    record(tt, TRACE_FILL, start, r, len, 0);
+    errno = errno_tmp;
+    return r;
+}
+
+static int trace_close(transport *t)
+{
+    trace_transport *tt = (trace_transport*) t;
+    long long start = now_ns();
+    int r;
+
+    r = transport_close(tt->inner);
+    record(tt, TRACE_CLOSE, start, r, 0, 0);
+    fflush(tt->f);
+    return r;
+}
+
+static void trace_cancel(transport *t)
+{
+    trace_transport *tt = (trace_transport*) t;
+
+    transport_cancel(tt->inner);
+}
+
+static int trace_recover(transport *t, int hard)
+{
+    trace_transport *tt = (trace_transport*) t;
+
+    return transport_recover(tt->inner, hard);
+}
+
+static void *trace_buf_alloc(transport *t, unsigned len)
+{
+    trace_transport *tt = (trace_transport*) t;
+
+    return transport_buf_alloc(tt->inner, len);
+}
+
+static void trace_buf_free(transport *t, void *buf, unsigned len)
+{
+    trace_transport *tt = (trace_transport*) t;
+
+    transport_buf_free(tt->inner, buf, len);
+}
+
+static const transport_ops trace_ops = {
+    .name = "trace",
+    .read = trace_read,
+    .write = trace_write,
+    .write_fill = trace_write_fill,
+    .write_message = trace_write_message,
+    .write_next = trace_write_next,
+    .close = trace_close,
+    .cancel = trace_cancel,
+    .recover = trace_recover,
+    .buf_alloc = trace_buf_alloc,
+    .buf_free = trace_buf_free,
+};
+
+transport *trace_open(transport *inner, const char *path)
+{
+    trace_transport *tt;
+    unsigned char hdr[8];
+
+    tt = calloc(1, sizeof(trace_transport));
+    if(tt == 0) return 0;
+
+    tt->f = fopen(path, "wb");
+    if(tt->f == 0) {
+        free(tt);
+        return 0;
+    }
+
+    memcpy(hdr, TRACE_MAGIC, 4);
+    put_le(hdr + 4, TRACE_VERSION, 4);
+    fwrite(hdr, sizeof(hdr), 1, tt->f);
+
+    tt->t.ops = &trace_ops;
+    tt->t.flags = inner->flags;
+    tt->t.max_xfer = inner->max_xfer;
+    tt->inner = inner;
+    tt->start = now_ns();
+    return &tt->t;
+}
+
+static void sleep_until(long long t)
+{
+    struct timespec ts;
+    long long d = t - now_ns();
+
+    if(d <= 0) return;
+    ts.tv_sec = d / 1000000000LL;
+    ts.tv_nsec = d % 1000000000LL;
+    while(nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/* replayed data phases carry this instead of the original image */
+static int pattern_fill(void *cookie, void *buf, int len)
+{
+    (void) cookie;
+    memset(buf, 0xa5, len);
+    return len;
+}
+
+int trace_replay(transport *t, const char *path)
+{
+    unsigned char rec[TRACE_RECORD];
+    unsigned char saved[TRACE_SAVE_MAX];
+    unsigned char *buf = 0;
+    unsigned buf_size = 0;
+    long long start, orig_end = 0;
+    unsigned records = 0, mismatches = 0;
+    FILE *f;
+    int r = 0;
+
+    f = fopen(path, "rb");
+    if(f == 0) {
+        fprintf(stderr, "cannot open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(fread(rec, 8, 1, f) != 1 || memcmp(rec, TRACE_MAGIC, 4) ||
+       get_le(rec + 4, 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    start = now_ns();
+    while(fread(rec, sizeof(rec), 1, f) == 1) {
+        long long when = get_le(rec, 8);
+        int op = rec[16];
+        int nsaved = get_le(rec + 18, 2);
+        int result = (int) get_le(rec + 20, 4);
+        unsigned len = get_le(rec + 24, 4);
+        int n;
+
+        if(nsaved > TRACE_SAVE_MAX || (nsaved && fread(saved, nsaved, 1, f) != 1)) {
+            fprintf(stderr, "%s: truncated record %u\n", path, records);
+            r = -1;
+            break;
+        }
+        orig_end = when + get_le(rec + 8, 8);
+        records++;
+
+        if(op == TRACE_READ) {
+            if(len > buf_size) {
+                free(buf);
+                buf = malloc(len);
+                buf_size = buf ? len : 0;
+                if(buf == 0) { r = -1; break; }
+            }
+            n = transport_read(t, buf, len, 0, 0);
+            if(n != result || (nsaved && memcmp(buf, saved, nsaved))) {
+                mismatches++;
+                fprintf(stderr, "record %u: read %d bytes, trace has %d\n",
+                        records, n, result);
+            }
+            if(n < 0) { r = -1; break; }
+            continue;
+        }
+
+        /* host side keeps its original pace */
+        sleep_until(start + when);
+        if(op == TRACE_WRITE && result >= 0) {
+            if(nsaved != result) {
+                /* a data phase sent straight from memory */
+                n = transport_write_fill(t, pattern_fill, 0, result, 0, 0);
+            } else {
+                n = transport_write(t, saved, nsaved, 0, 0);
+            }
+        } else if(op == TRACE_MESSAGE && result >= 0) {
+            n = transport_write_message(t, saved, nsaved, 0, 0);
+        } else if(op == TRACE_FILL && result >= 0) {
+            n = transport_write_fill(t, pattern_fill, 0, result, 0, 0);
+        } else if(op == TRACE_CLOSE) {
+            break;
+        } else {
+            /* failed in the original session, nothing to send */
+            continue;
+        }
+        if(n != result) {
+            fprintf(stderr, "record %u: wrote %d bytes, trace has %d (%s)\n",
+                    records, n, result, strerror(errno));
+            r = -1;
+            break;
+        }
+    }
+
+    fprintf(stderr, "replayed %u records, %u mismatched, %.3fs (original %.3fs)\n",
+            records, mismatches, (now_ns() - start) / 1e9, orig_end / 1e9);
+    free(buf);
+    fclose(f);
+    return r ? r : (mismatches ? -1 : 0);
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <errno.h>
+
+/* A link to one fastboot device. The protocol only talks to the device
+ * through these calls, each backend (usb_linux.c, usb_windows.c, ...)
+ * embeds a transport as the first member of its own handle.
+ */
+typedef struct transport transport;
+typedef struct transport_ops transport_ops;
+
+/* Produces the next @len bytes of outgoing data into @buf, returns the
+ * number of bytes written or -1 on error.
+ */
+typedef int (*transport_fill_func)(void *cookie, void *buf, int len);
+
+/* Outgoing data lent out where it already is. next points @buf at the
+ * next @len bytes at most and returns how many there are, 0 if none are
+ * ready yet and @wait is 0, or -1 on error. Lent bytes stay valid until
+ * release hands them back, oldest first, once they went out; so the
+ * transport can keep several pieces in flight.
+ */
+typedef struct transport_source
+{
+    int (*next)(void *cookie, const void **buf, int len, int wait);
+    void (*release)(void *cookie, int len);
+    void *cookie;
+} transport_source;
+
+/* transport flags */
+#define TRANSPORT_ASYNC     0x01    /* keeps several writes in flight */
+#define TRANSPORT_ZERO_COPY 0x02    /* fill writes straight into I/O buffers */
+
+/* All transfers give up after @timeout_ms (0 waits forever) with errno
+ * ETIMEDOUT, or ECANCELED after cancel. @done, if not NULL, receives the
+ * bytes moved before a failure.
+ */
+struct transport_ops
+{
+    const char *name;
+
+    int (*read)(transport *t, void *data, int len,
+                int timeout_ms, int *done);
+    int (*write)(transport *t, const void *data, int len,
+                 int timeout_ms, int *done);
+    int (*write_fill)(transport *t, transport_fill_func fill, void *cookie,
+                      int len, int timeout_ms, int *done);
+    /* optional: a command or other message the device has to see end on
+     * its own, where write may run on into a data phase; USB ends it
+     * with a zero-length packet after a whole number of packets */
+    int (*write_message)(transport *t, const void *data, int len,
+                         int timeout_ms, int *done);
+    /* optional: send @len bytes lent out by @src, without copying them */
+    int (*write_next)(transport *t, const transport_source *src, int len,
+                      int timeout_ms, int *done);
+
+    /* drop the link, the transport itself stays valid */
+    int (*close)(transport *t);
+    /* abort the current and all later transfers, from any thread */
+    void (*cancel)(transport *t);
+    /* optional: bring the link back after a failed transfer. Clearing
+     * halts leaves the device's protocol where it was, which is only
+     * enough between messages; @hard resets the device, which puts it
+     * back at a command.
+     */
+    int (*recover)(transport *t, int hard);
+    /* optional: memory that write sends in place instead of copying it,
+     * 0 if there is none to be had; buf_free gives it back */
+    void *(*buf_alloc)(transport *t, unsigned len);
+    void (*buf_free)(transport *t, void *buf, unsigned len);
+};
+
+struct transport
+{
+    const transport_ops *ops;
+    unsigned flags;
+    unsigned max_xfer;              /* bytes per transfer, 0 if unlimited */
+};
+
+static inline int transport_read(transport *t, void *data, int len,
+                                 int timeout_ms, int *done)
+{
+    return t->ops->read(t, data, len, timeout_ms, done);
+}
+
+static inline int transport_write(transport *t, const void *data, int len,
+                                  int timeout_ms, int *done)
+{
+    return t->ops->write(t, data, len, timeout_ms, done);
+}
+
+static inline int transport_write_fill(transport *t, transport_fill_func fill,
+                                       void *cookie, int len,
+                                       int timeout_ms, int *done)
+{
+    return t->ops->write_fill(t, fill, cookie, len, timeout_ms, done);
+}
+
+static inline int transport_write_message(transport *t, const void *data,
+                                          int len, int timeout_ms, int *done)
+{
+    if(t->ops->write_message)
+        return t->ops->write_message(t, data, len, timeout_ms, done);
+    return t->ops->write(t, data, len, timeout_ms, done);
+}
+
+/* without write_next of its own the transport gets one write per piece */
+static inline int transport_write_next(transport *t,
+                                       const transport_source *src, int len,
+                                       int timeout_ms, int *done)
+{
+    const void *buf;
+    int count = 0;
+    int n, sent, r;
+
+    if(t->ops->write_next)
+        return t->ops->write_next(t, src, len, timeout_ms, done);
+
+    if(done) *done = 0;
+    while(count < len) {
+        n = src->next(src->cookie, &buf, len - count, 1);
+        if(n <= 0) {
+            if(n == 0) errno = EIO;
+            return -1;
+        }
+        sent = 0;
+        r = t->ops->write(t, buf, n, timeout_ms, &sent);
+        if(r != n) {
+            if(done) *done = count + (r < 0 ? sent : r);
+            if(r >= 0) errno = EIO;
+            return -1;
+        }
+        src->release(src->cookie, n);
+        count += n;
+        if(done) *done = count;
+    }
+    return count;
+}
+
+static inline int transport_close(transport *t)
+{
+    return t->ops->close(t);
+}
+
+static inline void transport_cancel(transport *t)
+{
+    t->ops->cancel(t);
+}
+
+static inline int transport_recover(transport *t, int hard)
+{
+    if(t->ops->recover == 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return t->ops->recover(t, hard);
+}
+
+static inline void *transport_buf_alloc(transport *t, unsigned len)
+{
+    if(t->ops->buf_alloc == 0) return 0;
+    return t->ops->buf_alloc(t, len);
+}
+
+static inline void transport_buf_free(transport *t, void *buf, unsigned len)
+{
+    t->ops->buf_free(t, buf, len);
+}
+
+#endif
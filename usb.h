@@ -29,6 +29,8 @@
 #ifndef _USB_H_
 #define _USB_H_
 
+#include "transport.h"
+
 typedef struct usb_handle usb_handle;
 
 typedef struct usb_ifc_info usb_ifc_info;
@@ -53,14 +55,105 @@ struct usb_ifc_info
     unsigned char writable;
 
     char serial_number[256];
+
+    /* where to find the interface again, for usb_open_ifc */
+    char device_path[256];
+    /* bus and ports the device hangs off ("1-2.3"), stays the same
+     * across a reboot of the device; empty if unknown */
+    char port_path[64];
+    int ifc_number;
+    unsigned char ep_in;
+    unsigned char ep_out;
+    unsigned short max_packet;      /* of ep_out */
+    unsigned short in_packet;       /* of ep_in */
 };
   
 typedef int (*ifc_match_func)(usb_ifc_info *ifc);
 
 usb_handle *usb_open(ifc_match_func callback);
+
+/* Scan the bus once and return every interface @callback accepts in a
+ * malloc()ed array, without opening any of them. Returns the number of
+ * entries or -1 on error.
+ */
+int usb_enumerate(ifc_match_func callback, usb_ifc_info **list);
+usb_handle *usb_open_ifc(const usb_ifc_info *info);
+
+/* Like usb_enumerate, but look at the device on port @port (a port_path
+ * from an earlier scan) only.
+ */
+int usb_enumerate_port(const char *port, ifc_match_func callback,
+                       usb_ifc_info **list);
+
+/* Device arrival notification. Once started, usb_hotplug_wait() returns 1
+ * as soon as a USB device may have been added, 0 after @timeout_ms. If
+ * the host offers no notification it simply sleeps for @timeout_ms.
+ */
+int usb_hotplug_start(void);
+int usb_hotplug_wait(int timeout_ms);
+void usb_hotplug_stop(void);
 int usb_close(usb_handle *h);
 int usb_read(usb_handle *h, void *_data, int len);
 int usb_write(usb_handle *h, const void *_data, int len);
 
+/* number of bulk transfers usb_write may keep in flight at once */
+void usb_set_queue_depth(usb_handle *h, int depth);
+
+typedef struct usb_xfer_info usb_xfer_info;
+
+/* transfer settings the backend picked for an open handle, and how the
+ * transfers went so far
+ */
+struct usb_xfer_info
+{
+    unsigned xfer_size;             /* bytes per bulk transfer */
+    unsigned queue_depth;           /* transfers kept in flight */
+    unsigned max_packet;            /* wMaxPacketSize of the OUT endpoint */
+    unsigned in_packet;             /* wMaxPacketSize of the IN endpoint */
+    unsigned speed;                 /* link speed in Mbit/s, 0 if unknown */
+
+    unsigned char zero_copy;
+    unsigned char scatter_gather;
+    unsigned char no_packet_size_lim;
+
+    unsigned retries;               /* failed reads that were retried */
+    unsigned stall_ms;              /* time spent before those succeeded */
+};
+
+int usb_get_xfer_info(usb_handle *h, usb_xfer_info *info);
+
+typedef transport_fill_func usb_fill_func;
+
+/* Like usb_write, but the data is generated chunk by chunk by @fill
+ * directly into the transfer buffers of the USB layer, which on Linux are
+ * mapped from usbfs so no further copy is made.
+ */
+int usb_write_fill(usb_handle *h, usb_fill_func fill, void *cookie, int len);
+
+/* Transfers that give up after @timeout_ms (0 waits forever) with errno
+ * ETIMEDOUT, or with ECANCELED once usb_cancel() was called. @done, if not
+ * NULL, receives the bytes moved before the failure.
+ */
+int usb_read_timeout(usb_handle *h, void *_data, int len,
+                     int timeout_ms, int *done);
+int usb_write_timeout(usb_handle *h, const void *_data, int len,
+                      int timeout_ms, int *done);
+int usb_write_fill_timeout(usb_handle *h, usb_fill_func fill, void *cookie,
+                           int len, int timeout_ms, int *done);
+
+/* Abort the transfer in progress and all later ones on @h. Safe to call
+ * from another thread.
+ */
+void usb_cancel(usb_handle *h);
+
+/* Get a failed handle working again: reopen it if it was closed, clear
+ * endpoint halts, or with @hard (or if that fails) reset the device and
+ * find it again on its port.
+ */
+int usb_recover(usb_handle *h, int hard);
+
+/* the handle as a transport for the protocol code */
+transport *usb_transport(usb_handle *h);
+
 
 #endif
@@ -0,0 +1,1225 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the 
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED 
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * USB backend on libusb-1.0, an alternative to usb_linux.c for hosts where
+ * libusb's transfer handling does better than raw usbfs (USB/IP, some
+ * virtual machines). Bulk OUT data goes out as a queue of asynchronous
+ * transfers like the URB queue of usb_linux.c; every caller drives the
+ * libusb event loop itself until its own transfers complete, so several
+ * devices can be run from several threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "usb.h"
+
+#define MAX_RETRIES 8
+
+/* a failed read is retried after 1, 2, 4 .. 64ms */
+#define RETRY_BACKOFF_MIN_MS 1
+#define RETRY_BACKOFF_MAX_MS 64
+
+#ifdef TRACE_USB
+#define DBG1(x...) fprintf(stderr, x)
+#define DBG(x...) fprintf(stderr, x)
+#else
+#define DBG(x...)
+#define DBG1(x...)
+#endif
+
+/* libusb splits larger transfers into URBs itself, so we can go big */
+#define LIBUSB_XFER_SIZE (1024 * 1024)
+
+/* Fastboot's command buffer. A shorter write that ends on a packet
+ * boundary gets a zero-length packet, or the device would wait for more.
+ */
+#define USB_MESSAGE_SIZE 64
+
+#define DEFAULT_XFER_DEPTH 8
+#define MAX_XFER_DEPTH 64
+
+/* configure asks for libusb 1.0.16 (port numbers, hotplug); 1.0.21 added
+ * device memory and waking the event loop */
+#if LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_DEV_MEM 1
+#define HAVE_INTERRUPT 1
+#endif
+
+/* without libusb_interrupt_event_handler a cancel is noticed this late */
+#define EVENT_SLICE_MS 100
+
+/* how long cancelled transfers get to come back */
+#define CANCEL_WAIT_MS 2000
+
+struct usb_handle
+{
+    /* must stay first, the transport calls cast back to the handle */
+    transport t;
+
+    libusb_device_handle *dev;
+    /* bus and port numbers, to find the device again */
+    char path[64];
+    unsigned char ep_in;
+    unsigned char ep_out;
+    int ifc;
+    /* wMaxPacketSize of the OUT and IN endpoints */
+    int max_packet;
+    int in_packet;
+    /* link speed in Mbit/s, 0 if unknown */
+    int speed;
+
+    /* last read ended on a packet boundary, a ZLP may follow it */
+    int zlp_pending;
+    /* reads that aren't whole packets land here first */
+    unsigned char *bounce;
+    int bounce_size;
+
+    /* set by usb_cancel(), fails all later transfers */
+    volatile int cancelled;
+    /* transfers were abandoned in flight, only a reset brings it back */
+    int stuck;
+
+    /* read retries so far, and the time spent waiting on them */
+    unsigned retries;
+    long long stall_ms;
+
+    int xfer_size;
+    int depth;
+    struct libusb_transfer *xfers[MAX_XFER_DEPTH];
+    /* set by the completion callback of the matching transfer */
+    int done[MAX_XFER_DEPTH];
+
+    /* transfer buffers for usb_write_fill, from libusb_dev_mem_alloc
+     * (usbfs memory, no copy) where possible */
+    int pool_size;
+    int pool_buf_size;
+    unsigned char *pool[MAX_XFER_DEPTH];
+    unsigned char pool_dev_mem[MAX_XFER_DEPTH];
+};
+
+static const transport_ops usb_ops;
+
+static libusb_context *ctx;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static int ctx_error;
+
+static void ctx_init(void)
+{
+    ctx_error = libusb_init(&ctx);
+    if(ctx_error) {
+        DBG("ERROR: libusb_init: %s\n", libusb_error_name(ctx_error));
+        ctx = 0;
+    }
+}
+
+static int get_ctx(void)
+{
+    pthread_once(&ctx_once, ctx_init);
+    if(ctx == 0) {
+        errno = ENODEV;
+        return -1;
+    }
+    return 0;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long deadline_of(int timeout_ms)
+{
+    return timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+}
+
+/* errno for a LIBUSB_ERROR_* code */
+static int error_errno(int r)
+{
+    switch(r) {
+    case LIBUSB_ERROR_IO: return EIO;
+    case LIBUSB_ERROR_INVALID_PARAM: return EINVAL;
+    case LIBUSB_ERROR_ACCESS: return EACCES;
+    case LIBUSB_ERROR_NO_DEVICE: return ENODEV;
+    case LIBUSB_ERROR_NOT_FOUND: return ENOENT;
+    case LIBUSB_ERROR_BUSY: return EBUSY;
+    case LIBUSB_ERROR_TIMEOUT: return ETIMEDOUT;
+    case LIBUSB_ERROR_OVERFLOW: return EOVERFLOW;
+    case LIBUSB_ERROR_PIPE: return EPIPE;
+    case LIBUSB_ERROR_INTERRUPTED: return EINTR;
+    case LIBUSB_ERROR_NO_MEM: return ENOMEM;
+    case LIBUSB_ERROR_NOT_SUPPORTED: return ENOTSUP;
+    default: return EIO;
+    }
+}
+
+/* errno for a finished transfer, 0 if it went through */
+static int status_errno(enum libusb_transfer_status status)
+{
+    switch(status) {
+    case LIBUSB_TRANSFER_COMPLETED: return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT: return ETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED: return ECANCELED;
+    case LIBUSB_TRANSFER_STALL: return EPIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return ENODEV;
+    case LIBUSB_TRANSFER_OVERFLOW: return EOVERFLOW;
+    default: return EIO;
+    }
+}
+
+static int speed_mbps(int speed)
+{
+    switch(speed) {
+    case LIBUSB_SPEED_LOW: return 1;        /* really 1.5 */
+    case LIBUSB_SPEED_FULL: return 12;
+    case LIBUSB_SPEED_HIGH: return 480;
+    case LIBUSB_SPEED_SUPER: return 5000;
+#if LIBUSB_API_VERSION >= 0x01000106
+    case LIBUSB_SPEED_SUPER_PLUS: return 10000;
+#endif
+    default: return 0;
+    }
+}
+
+/* bulk wMaxPacketSize fixed by the spec, for descriptors that lack one */
+static int speed_packet(int speed)
+{
+    if(speed >= 5000) return 1024;
+    if(speed >= 480) return 512;
+    return 64;
+}
+
+/* "bus-port.port...", like the device's name in sysfs */
+static void device_path(libusb_device *d, char *buf, int size)
+{
+    uint8_t ports[8];
+    int n, i, len;
+
+    len = snprintf(buf, size, "%d", libusb_get_bus_number(d));
+    n = libusb_get_port_numbers(d, ports, sizeof(ports));
+    for(i = 0; i < n && len < size; i++)
+        len += snprintf(buf + len, size - len, "%c%d", i ? '.' : '-',
+                        ports[i]);
+}
+
+static void LIBUSB_CALL xfer_done(struct libusb_transfer *x)
+{
+    *(int*) x->user_data = 1;
+}
+
+/* Run the event loop until @done is set, until @deadline (0: forever) or
+ * the handle is cancelled, failing with ETIMEDOUT or ECANCELED then.
+ */
+static int wait_done(usb_handle *h, int *done, long long deadline)
+{
+    struct timeval tv;
+    long long left;
+    int r;
+
+    while(!*done) {
+        if(h->cancelled) {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        left = EVENT_SLICE_MS;
+#ifdef HAVE_INTERRUPT
+        left = 60 * 1000;
+#endif
+        if(deadline) {
+            if(deadline - now_ms() < left)
+                left = deadline - now_ms();
+            if(left <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        tv.tv_sec = left / 1000;
+        tv.tv_usec = (left % 1000) * 1000;
+
+        r = libusb_handle_events_timeout_completed(ctx, &tv, done);
+        if(r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+            errno = error_errno(r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* where the callbacks of abandoned transfers report */
+static int abandoned_done;
+
+/* Cancel @inflight transfers from @tail on and wait until libusb gave
+ * them all back, their buffers may be reused after that. One that isn't
+ * back within CANCEL_WAIT_MS is left to libusb and its slot gets a new
+ * transfer; the handle then refuses transfers until a reset has killed
+ * whatever the device still holds.
+ */
+static void cancel_xfers(usb_handle *h, int tail, int inflight)
+{
+    long long deadline = now_ms() + CANCEL_WAIT_MS;
+    struct libusb_transfer *x;
+    struct timeval tv;
+    long long left;
+    int i, slot;
+
+    for(i = 0; i < inflight; i++)
+        libusb_cancel_transfer(h->xfers[(tail + i) % h->depth]);
+
+    for(i = 0; i < inflight; i++) {
+        slot = (tail + i) % h->depth;
+        while(!h->done[slot] && (left = deadline - now_ms()) > 0) {
+            tv.tv_sec = left / 1000;
+            tv.tv_usec = (left % 1000) * 1000;
+            libusb_handle_events_timeout_completed(ctx, &tv, &h->done[slot]);
+        }
+        if(h->done[slot])
+            continue;
+
+        DBG("ERROR: transfer %d not back after cancel, abandoned\n", slot);
+        x = libusb_alloc_transfer(0);
+        if(x == 0) {
+            /* keep the old one, nothing is submitted until the reset */
+            h->stuck = 1;
+            continue;
+        }
+        h->xfers[slot]->user_data = &abandoned_done;
+        h->xfers[slot] = x;
+        h->done[slot] = 1;
+        h->stuck = 1;
+    }
+}
+
+static int clear_halt(usb_handle *h, unsigned char ep)
+{
+    int r;
+
+    r = libusb_clear_halt(h->dev, ep);
+    if(r) {
+        DBG("ERROR: clear halt on ep 0x%02x: %s\n", ep, libusb_error_name(r));
+        errno = error_errno(r);
+        return -1;
+    }
+    DBG("[ cleared halt on ep 0x%02x ]\n", ep);
+    return 0;
+}
+
+static int submit(usb_handle *h, int slot, unsigned char ep, void *data,
+                  int len, unsigned char flags)
+{
+    struct libusb_transfer *x = h->xfers[slot];
+    int r;
+
+    if(h->stuck) {
+        errno = EIO;
+        return -1;
+    }
+
+    libusb_fill_bulk_transfer(x, h->dev, ep, data, len, xfer_done,
+                              &h->done[slot], 0);
+    x->flags = flags;
+    h->done[slot] = 0;
+
+    r = libusb_submit_transfer(x);
+    if(r) {
+        h->done[slot] = 1;
+        errno = error_errno(r);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send one transfer and wait for it, returns the bytes transferred. */
+static int single_xfer(usb_handle *h, unsigned char ep, void *data, int len,
+                       unsigned char flags, long long deadline)
+{
+    struct libusb_transfer *x = h->xfers[0];
+    int n;
+
+    if(h->dev == 0) {
+        errno = ENODEV;
+        return -1;
+    }
+    if(submit(h, 0, ep, data, len, flags))
+        return -1;
+
+    if(wait_done(h, &h->done[0], deadline)) {
+        n = errno;
+        cancel_xfers(h, 0, 1);
+        errno = n;
+        return -1;
+    }
+
+    n = status_errno(x->status);
+    if(n) {
+        if(n == EPIPE)
+            clear_halt(h, ep);
+        errno = n;
+        return -1;
+    }
+    return x->actual_length;
+}
+
+static void free_pool(usb_handle *h)
+{
+    int i;
+
+    for(i = 0; i < h->pool_size; i++) {
+#ifdef HAVE_DEV_MEM
+        if(h->pool_dev_mem[i])
+            libusb_dev_mem_free(h->dev, h->pool[i], h->pool_buf_size);
+        else
+#endif
+            free(h->pool[i]);
+        h->pool[i] = 0;
+    }
+    h->pool_size = 0;
+}
+
+static int alloc_pool(usb_handle *h)
+{
+    unsigned char *buf;
+
+    if(h->pool_buf_size != h->xfer_size) {
+        free_pool(h);
+        h->pool_buf_size = h->xfer_size;
+    }
+
+    while(h->pool_size < h->depth) {
+        buf = 0;
+#ifdef HAVE_DEV_MEM
+        buf = libusb_dev_mem_alloc(h->dev, h->pool_buf_size);
+#endif
+        if(buf) {
+            h->pool_dev_mem[h->pool_size] = 1;
+        } else {
+            buf = malloc(h->pool_buf_size);
+            if(buf == 0) return -1;
+            h->pool_dev_mem[h->pool_size] = 0;
+        }
+        DBG("[ transfer buffer %d %s ]\n", h->pool_size,
+            h->pool_dev_mem[h->pool_size] ? "zero-copy" : "copied");
+        h->pool[h->pool_size++] = buf;
+    }
+    return 0;
+}
+
+static void pick_xfer_size(usb_handle *h)
+{
+    int size = LIBUSB_XFER_SIZE;
+
+    /* whole packets only, so a short packet ends just the last transfer */
+    size -= size % h->max_packet;
+    h->xfer_size = size;
+    h->t.max_xfer = size;
+}
+
+/* Stream @len bytes to the OUT endpoint through the transfer queue, from
+ * @data in place, produced by @fill into the pool buffers, or lent out
+ * by @src and released as their transfers come back.
+ */
+static int bulk_out(usb_handle *h, const unsigned char *data,
+                    usb_fill_func fill, void *cookie,
+                    const transport_source *src, int len,
+                    long long deadline, int *done)
+{
+    unsigned count = 0;
+    unsigned submitted = 0;
+    int head = 0, tail = 0, inflight = 0;
+    struct libusb_transfer *x;
+    unsigned char *buf;
+    int n;
+
+    if(h->dev == 0) {
+        errno = ENODEV;
+        return -1;
+    }
+    if(fill && alloc_pool(h)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(count < (unsigned) len) {
+        /* keep the queue full */
+        while(inflight < h->depth && submitted < (unsigned) len) {
+            int xfer = len - submitted;
+            if(xfer > h->xfer_size) xfer = h->xfer_size;
+
+            if(data) {
+                buf = (unsigned char*) data + submitted;
+            } else if(src) {
+                const void *piece;
+
+                /* only wait for the source with nothing left to reap */
+                n = src->next(src->cookie, &piece, xfer, inflight == 0);
+                if(n < 0) {
+                    n = errno ? errno : EIO;
+                    DBG("ERROR: source of %d bytes failed\n", xfer);
+                    cancel_xfers(h, tail, inflight);
+                    errno = n;
+                    return -1;
+                }
+                if(n == 0) break;
+                xfer = n;
+                buf = (unsigned char*) piece;
+            } else {
+                buf = h->pool[head];
+                if(fill(cookie, buf, xfer) != xfer) {
+                    n = errno ? errno : EIO;
+                    DBG("ERROR: fill of %d bytes failed\n", xfer);
+                    cancel_xfers(h, tail, inflight);
+                    errno = n;
+                    return -1;
+                }
+            }
+
+            if(submit(h, head, h->ep_out, buf, xfer, 0)) {
+                n = errno;
+                DBG("ERROR: submit failed, errno = %d (%s)\n",
+                    n, strerror(n));
+                cancel_xfers(h, tail, inflight);
+                errno = n;
+                return -1;
+            }
+
+            submitted += xfer;
+            head = (head + 1) % h->depth;
+            inflight++;
+        }
+
+        /* transfers on one endpoint complete in order */
+        if(wait_done(h, &h->done[tail], deadline)) {
+            n = errno;
+            DBG("ERROR: wait failed, errno = %d (%s)\n", n, strerror(n));
+            cancel_xfers(h, tail, inflight);
+            errno = n;
+            return -1;
+        }
+        x = h->xfers[tail];
+        tail = (tail + 1) % h->depth;
+        inflight--;
+
+        if(x->status != LIBUSB_TRANSFER_COMPLETED ||
+           x->actual_length != x->length) {
+            DBG("ERROR: transfer status = %d, %d of %d bytes\n", x->status,
+                x->actual_length, x->length);
+            if(done) *done = count + x->actual_length;
+            n = status_errno(x->status);
+            cancel_xfers(h, tail, inflight);
+            if(n == EPIPE)
+                clear_halt(h, h->ep_out);
+            errno = n ? n : EIO;
+            return -1;
+        }
+
+        if(src) src->release(src->cookie, x->actual_length);
+        count += x->actual_length;
+        if(done) *done = count;
+    }
+
+    return count;
+}
+
+/* Sleep @ms before retrying a failed read, ECANCELED/ETIMEDOUT like
+ * wait_done().
+ */
+static int backoff(usb_handle *h, int ms, long long deadline)
+{
+    long long until = now_ms() + ms;
+    int never = 0;
+
+    if(deadline && deadline < until) {
+        if(deadline <= now_ms()) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        until = deadline;
+    }
+
+    /* a cancel wakes the event loop, running it serves as the sleep */
+    if(wait_done(h, &never, until) && errno == ECANCELED)
+        return -1;
+    return 0;
+}
+
+void usb_set_queue_depth(usb_handle *h, int depth)
+{
+    if(depth < 1) depth = 1;
+    if(depth > MAX_XFER_DEPTH) depth = MAX_XFER_DEPTH;
+
+    /* buffers are per slot, start over with the new count */
+    free_pool(h);
+    h->depth = depth;
+}
+
+int usb_get_xfer_info(usb_handle *h, usb_xfer_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->xfer_size = h->xfer_size;
+    info->queue_depth = h->depth;
+    info->max_packet = h->max_packet;
+    info->in_packet = h->in_packet;
+    info->speed = h->speed;
+#ifdef HAVE_DEV_MEM
+    info->zero_copy = h->pool_size ? h->pool_dev_mem[0] : 0;
+#endif
+    /* libusb splits transfers for the kernel as it needs to */
+    info->scatter_gather = 1;
+    info->no_packet_size_lim = 1;
+    info->retries = h->retries;
+    info->stall_ms = h->stall_ms;
+    return 0;
+}
+
+int usb_write_timeout(usb_handle *h, const void *_data, int len,
+                      int timeout_ms, int *done)
+{
+    long long deadline = deadline_of(timeout_ms);
+    int n;
+
+    if(done) *done = 0;
+    if(h->ep_out == 0) {
+        return -1;
+    }
+
+    if(len == 0) {
+        n = single_xfer(h, h->ep_out, (void*) _data, 0, 0, deadline);
+        if(n != 0) {
+            fprintf(stderr,"ERROR: n = %d, errno = %d (%s)\n",
+                    n, errno, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    return bulk_out(h, _data, 0, 0, 0, len, deadline, done);
+}
+
+/* A command the device can't tell is complete without a ZLP. Data phases
+ * never get one, their size is known and a piece of one ending on a
+ * packet boundary must not end it.
+ */
+static int usb_write_message(usb_handle *h, const void *data, int len,
+                             int timeout_ms, int *done)
+{
+    int n;
+
+    if(len == 0 || len >= USB_MESSAGE_SIZE || len % h->max_packet ||
+       h->ep_out == 0)
+        return usb_write_timeout(h, data, len, timeout_ms, done);
+
+    if(done) *done = 0;
+    n = single_xfer(h, h->ep_out, (void*) data, len,
+                    LIBUSB_TRANSFER_ADD_ZERO_PACKET, deadline_of(timeout_ms));
+    if(n >= 0 && done) *done = n;
+    return n;
+}
+
+int usb_write(usb_handle *h, const void *_data, int len)
+{
+    return usb_write_timeout(h, _data, len, 0, 0);
+}
+
+int usb_write_fill_timeout(usb_handle *h, usb_fill_func fill, void *cookie,
+                           int len, int timeout_ms, int *done)
+{
+    if(done) *done = 0;
+    if(h->ep_out == 0) {
+        return -1;
+    }
+
+    if(len == 0) {
+        return usb_write_timeout(h, 0, 0, timeout_ms, 0);
+    }
+
+    return bulk_out(h, 0, fill, cookie, 0, len, deadline_of(timeout_ms),
+                    done);
+}
+
+int usb_write_fill(usb_handle *h, usb_fill_func fill, void *cookie, int len)
+{
+    return usb_write_fill_timeout(h, fill, cookie, len, 0, 0);
+}
+
+int usb_read_timeout(usb_handle *h, void *_data, int len,
+                     int timeout_ms, int *done)
+{
+    unsigned char *data = (unsigned char*) _data;
+    long long deadline = deadline_of(timeout_ms);
+    int backoff_ms = RETRY_BACKOFF_MIN_MS;
+    long long stall;
+    unsigned count = 0;
+    unsigned char *buf;
+    int n, retry, xfer_len;
+
+    if(done) *done = 0;
+    if(h->ep_in == 0) {
+        return -1;
+    }
+
+    while(len > 0) {
+        int xfer = (len > h->xfer_size) ? h->xfer_size : len;
+
+        retry = 0;
+        stall = 0;
+
+        /* the device may send a whole packet whatever we ask for, so
+         * a partial packet is read into the bounce buffer */
+        if(xfer % h->in_packet) {
+            xfer_len = xfer + h->in_packet - xfer % h->in_packet;
+            if(xfer_len > h->bounce_size) {
+                free(h->bounce);
+                h->bounce = malloc(xfer_len);
+                h->bounce_size = h->bounce ? xfer_len : 0;
+                if(h->bounce == 0) return -1;
+            }
+            buf = h->bounce;
+        } else {
+            xfer_len = xfer;
+            buf = data;
+        }
+
+        do {
+            DBG("[ usb read %d, %s ]\n", xfer, h->path);
+            n = single_xfer(h, h->ep_in, buf, xfer_len, 0, deadline);
+            /* the ZLP ending the previous message, not this one */
+            if(n == 0 && count == 0 && h->zlp_pending) {
+                h->zlp_pending = 0;
+                n = single_xfer(h, h->ep_in, buf, xfer_len, 0, deadline);
+            }
+            DBG("[ usb read %d ] = %d, %s, retry %d\n", xfer, n, h->path, retry);
+
+            if(n < 0) {
+                DBG1("ERROR: n = %d, errno = %d (%s)\n", n, errno, strerror(errno));
+                /* out of time, or nothing left to retry on */
+                if(errno == ETIMEDOUT || errno == ECANCELED || errno == ENODEV)
+                    break;
+                if(++retry > MAX_RETRIES) break;
+                if(!stall) stall = now_ms();
+                h->retries++;
+                if(backoff(h, backoff_ms, deadline)) break;
+                if(backoff_ms < RETRY_BACKOFF_MAX_MS) backoff_ms *= 2;
+            }
+        } while(n < 0);
+
+        if(stall) {
+            h->stall_ms += now_ms() - stall;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        /* a short read that ends on a packet boundary was ended by a ZLP */
+        h->zlp_pending = (n == xfer_len && n % h->in_packet == 0);
+
+        if(buf != data) {
+            if(n > xfer) {
+                DBG("ERROR: %d bytes for a %d byte read\n", n, xfer);
+                errno = EOVERFLOW;
+                return -1;
+            }
+            memcpy(data, buf, n);
+        }
+
+        count += n;
+        len -= n;
+        data += n;
+        if(done) *done = count;
+
+        if(n < xfer) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+int usb_read(usb_handle *h, void *_data, int len)
+{
+    return usb_read_timeout(h, _data, len, 0, 0);
+}
+
+void usb_cancel(usb_handle *h)
+{
+    h->cancelled = 1;
+#ifdef HAVE_INTERRUPT
+    libusb_interrupt_event_handler(ctx);
+#endif
+}
+
+/* the device at bus and port @path, with a reference taken */
+static libusb_device *find_device(const char *path)
+{
+    libusb_device **list;
+    libusb_device *found = 0;
+    char name[64];
+    ssize_t n, i;
+
+    n = libusb_get_device_list(ctx, &list);
+    if(n < 0) {
+        errno = error_errno(n);
+        return 0;
+    }
+    for(i = 0; i < n && found == 0; i++) {
+        device_path(list[i], name, sizeof(name));
+        if(!strcmp(name, path))
+            found = libusb_ref_device(list[i]);
+    }
+    libusb_free_device_list(list, 1);
+
+    if(found == 0) errno = ENODEV;
+    return found;
+}
+
+/* open the device at h->path and claim our interface on it */
+static int open_path(usb_handle *h)
+{
+    libusb_device *d;
+    int r;
+
+    d = find_device(h->path);
+    if(d == 0) return -1;
+
+    r = libusb_open(d, &h->dev);
+    libusb_unref_device(d);
+    if(r) {
+        h->dev = 0;
+        errno = error_errno(r);
+        return -1;
+    }
+
+    libusb_set_auto_detach_kernel_driver(h->dev, 1);
+    r = libusb_claim_interface(h->dev, h->ifc);
+    if(r) {
+        libusb_close(h->dev);
+        h->dev = 0;
+        errno = error_errno(r);
+        return -1;
+    }
+    return 0;
+}
+
+int usb_recover(usb_handle *h, int hard)
+{
+    int r;
+
+    /* the protocol closes the link on errors, take it back first */
+    if(h->dev == 0) {
+        if(open_path(h))
+            return -1;
+        h->cancelled = 0;
+    }
+
+    if(!hard && !h->stuck) {
+        if(clear_halt(h, h->ep_out) == 0 && clear_halt(h, h->ep_in) == 0)
+            return 0;
+    }
+
+    /* last resort, also puts the device's protocol back at a command */
+    DBG("[ resetting %s ]\n", h->path);
+    free_pool(h);
+    r = libusb_reset_device(h->dev);
+    if(r == LIBUSB_ERROR_NOT_FOUND) {
+        /* came back as a new device, on the same port */
+        libusb_close(h->dev);
+        h->dev = 0;
+        if(open_path(h))
+            return -1;
+    } else if(r) {
+        errno = error_errno(r);
+        return -1;
+    }
+    h->stuck = 0;
+    h->zlp_pending = 0;
+    return 0;
+}
+
+static int usb_t_read(transport *t, void *data, int len,
+                      int timeout_ms, int *done)
+{
+    return usb_read_timeout((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write(transport *t, const void *data, int len,
+                       int timeout_ms, int *done)
+{
+    return usb_write_timeout((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write_message(transport *t, const void *data, int len,
+                               int timeout_ms, int *done)
+{
+    return usb_write_message((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write_fill(transport *t, transport_fill_func fill,
+                            void *cookie, int len, int timeout_ms, int *done)
+{
+    return usb_write_fill_timeout((usb_handle*) t, fill, cookie, len,
+                                  timeout_ms, done);
+}
+
+static int usb_t_write_next(transport *t, const transport_source *src,
+                            int len, int timeout_ms, int *done)
+{
+    usb_handle *h = (usb_handle*) t;
+
+    if(done) *done = 0;
+    if(h->ep_out == 0) {
+        return -1;
+    }
+    if(len == 0) {
+        return usb_write_timeout(h, 0, 0, timeout_ms, 0);
+    }
+
+    return bulk_out(h, 0, 0, 0, src, len, deadline_of(timeout_ms), done);
+}
+
+static int usb_t_close(transport *t)
+{
+    return usb_close((usb_handle*) t);
+}
+
+static void usb_t_cancel(transport *t)
+{
+    usb_cancel((usb_handle*) t);
+}
+
+static int usb_t_recover(transport *t, int hard)
+{
+    return usb_recover((usb_handle*) t, hard);
+}
+
+static const transport_ops usb_ops = {
+    .name = "libusb",
+    .read = usb_t_read,
+    .write = usb_t_write,
+    .write_fill = usb_t_write_fill,
+    .write_message = usb_t_write_message,
+    .write_next = usb_t_write_next,
+    .close = usb_t_close,
+    .cancel = usb_t_cancel,
+    .recover = usb_t_recover,
+};
+
+transport *usb_transport(usb_handle *h)
+{
+    return &h->t;
+}
+
+/* The handle stays usable for usb_recover(), which opens it again. */
+int usb_close(usb_handle *h)
+{
+    if(h->dev == 0)
+        return 0;
+
+    /* device memory goes with the device handle */
+    free_pool(h);
+    free(h->bounce);
+    h->bounce = 0;
+    h->bounce_size = 0;
+    libusb_release_interface(h->dev, h->ifc);
+    libusb_close(h->dev);
+    h->dev = 0;
+    DBG("[ usb closed %s ]\n", h->path);
+
+    return 0;
+}
+
+/* Match the interfaces of @d against @callback, fill @info with the
+ * first one accepted. The device is opened for the serial number only.
+ */
+static int filter_device(libusb_device *d, ifc_match_func callback,
+                         usb_ifc_info *info)
+{
+    struct libusb_device_descriptor dev;
+    struct libusb_config_descriptor *cfg;
+    const struct libusb_interface_descriptor *ifc;
+    const struct libusb_endpoint_descriptor *ept;
+    libusb_device_handle *dh;
+    int speed;
+    int i, e, r;
+
+    if(libusb_get_device_descriptor(d, &dev))
+        return -1;
+    if(libusb_get_active_config_descriptor(d, &cfg))
+        return -1;
+
+    memset(info, 0, sizeof(*info));
+    info->dev_vendor = dev.idVendor;
+    info->dev_product = dev.idProduct;
+    info->dev_class = dev.bDeviceClass;
+    info->dev_subclass = dev.bDeviceSubClass;
+    info->dev_protocol = dev.bDeviceProtocol;
+    device_path(d, info->device_path, sizeof(info->device_path));
+    device_path(d, info->port_path, sizeof(info->port_path));
+    speed = speed_mbps(libusb_get_device_speed(d));
+
+    r = libusb_open(d, &dh);
+    info->writable = (r != LIBUSB_ERROR_ACCESS);
+    if(r == 0) {
+        if(dev.iSerialNumber)
+            libusb_get_string_descriptor_ascii(dh, dev.iSerialNumber,
+                    (unsigned char*) info->serial_number,
+                    sizeof(info->serial_number));
+        libusb_close(dh);
+    }
+
+    for(i = 0; i < cfg->bNumInterfaces; i++) {
+        if(cfg->interface[i].num_altsetting < 1)
+            continue;
+        ifc = &cfg->interface[i].altsetting[0];
+
+        info->ifc_class = ifc->bInterfaceClass;
+        info->ifc_subclass = ifc->bInterfaceSubClass;
+        info->ifc_protocol = ifc->bInterfaceProtocol;
+        info->ifc_number = ifc->bInterfaceNumber;
+        info->ep_in = 0;
+        info->ep_out = 0;
+        info->max_packet = 0;
+        info->in_packet = 0;
+
+        for(e = 0; e < ifc->bNumEndpoints; e++) {
+            ept = &ifc->endpoint[e];
+            if((ept->bmAttributes & 0x03) != LIBUSB_TRANSFER_TYPE_BULK)
+                continue;
+            if(ept->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+                info->ep_in = ept->bEndpointAddress;
+                info->in_packet = ept->wMaxPacketSize & 0x7ff;
+            } else {
+                info->ep_out = ept->bEndpointAddress;
+                info->max_packet = ept->wMaxPacketSize & 0x7ff;
+            }
+        }
+        info->has_bulk_in = info->ep_in != 0;
+        info->has_bulk_out = info->ep_out != 0;
+        if(!info->max_packet) info->max_packet = speed_packet(speed);
+        if(!info->in_packet) info->in_packet = speed_packet(speed);
+
+        if(callback(info) == 0) {
+            libusb_free_config_descriptor(cfg);
+            return 0;
+        }
+    }
+
+    libusb_free_config_descriptor(cfg);
+    return -1;
+}
+
+int usb_enumerate(ifc_match_func callback, usb_ifc_info **list)
+{
+    libusb_device **devs;
+    usb_ifc_info info;
+    usb_ifc_info *items = 0, *p;
+    int count = 0;
+    ssize_t n, i;
+
+    *list = 0;
+    if(get_ctx())
+        return -1;
+
+    n = libusb_get_device_list(ctx, &devs);
+    if(n < 0) {
+        errno = error_errno(n);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(filter_device(devs[i], callback, &info))
+            continue;
+        p = realloc(items, (count + 1) * sizeof(*items));
+        if(p == 0) break;
+        items = p;
+        items[count++] = info;
+    }
+    libusb_free_device_list(devs, 1);
+
+    *list = items;
+    return count;
+}
+
+int usb_enumerate_port(const char *port, ifc_match_func callback,
+                       usb_ifc_info **list)
+{
+    libusb_device *d;
+    usb_ifc_info info;
+
+    *list = 0;
+    if(get_ctx())
+        return -1;
+
+    d = find_device(port);
+    if(d == 0)
+        return 0;
+    if(filter_device(d, callback, &info) == 0) {
+        *list = malloc(sizeof(info));
+        if(*list) **list = info;
+    }
+    libusb_unref_device(d);
+
+    return *list ? 1 : 0;
+}
+
+usb_handle *usb_open_ifc(const usb_ifc_info *info)
+{
+    usb_handle *h;
+    int i;
+
+    if(get_ctx())
+        return 0;
+
+    h = calloc(1, sizeof(usb_handle));
+    if(h == 0) return 0;
+
+    if(snprintf(h->path, sizeof(h->path), "%s", info->device_path) >=
+       (int) sizeof(h->path)) {
+        free(h);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    h->ifc = info->ifc_number;
+    h->ep_in = info->ep_in;
+    h->ep_out = info->ep_out;
+    if(open_path(h)) {
+        free(h);
+        return 0;
+    }
+
+    h->speed = speed_mbps(libusb_get_device_speed(libusb_get_device(h->dev)));
+    h->max_packet = info->max_packet ? info->max_packet
+                                     : speed_packet(h->speed);
+    h->in_packet = info->in_packet ? info->in_packet : speed_packet(h->speed);
+    h->depth = DEFAULT_XFER_DEPTH;
+    h->t.ops = &usb_ops;
+    h->t.flags = TRANSPORT_ASYNC;
+#ifdef HAVE_DEV_MEM
+    h->t.flags |= TRANSPORT_ZERO_COPY;
+#endif
+    pick_xfer_size(h);
+
+    for(i = 0; i < MAX_XFER_DEPTH; i++) {
+        h->xfers[i] = libusb_alloc_transfer(0);
+        if(h->xfers[i] == 0) {
+            usb_close(h);
+            while(i-- > 0)
+                libusb_free_transfer(h->xfers[i]);
+            free(h);
+            errno = ENOMEM;
+            return 0;
+        }
+        h->done[i] = 1;
+    }
+
+    DBG("[ libusb %s, max packet %d/%d, xfer %d ]\n", h->path,
+        h->max_packet, h->in_packet, h->xfer_size);
+    return h;
+}
+
+usb_handle *usb_open(ifc_match_func callback)
+{
+    usb_ifc_info *list;
+    usb_handle *usb = 0;
+    int n, i;
+
+    n = usb_enumerate(callback, &list);
+    for(i = 0; i < n && usb == 0; i++)
+        usb = usb_open_ifc(&list[i]);
+    free(list);
+
+    return usb;
+}
+
+/* Hotplug through libusb where the platform has it, otherwise waits just
+ * sleep.
+ */
+static int hotplug_arrived;
+static int hotplug_on;
+static libusb_hotplug_callback_handle hotplug_cb;
+
+static int LIBUSB_CALL hotplug_event(libusb_context *c, libusb_device *d,
+                                     libusb_hotplug_event event, void *arg)
+{
+    (void) c;
+    (void) d;
+    (void) event;
+    (void) arg;
+    hotplug_arrived = 1;
+    return 0;
+}
+
+int usb_hotplug_start(void)
+{
+    if(hotplug_on || get_ctx())
+        return -1;
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return -1;
+    if(libusb_hotplug_register_callback(ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, hotplug_event, 0, &hotplug_cb))
+        return -1;
+    hotplug_on = 1;
+    return 0;
+}
+
+void usb_hotplug_stop(void)
+{
+    if(hotplug_on)
+        libusb_hotplug_deregister_callback(ctx, hotplug_cb);
+    hotplug_on = 0;
+}
+
+int usb_hotplug_wait(int timeout_ms)
+{
+    struct timeval tv;
+
+    if(!hotplug_on) {
+        usleep(timeout_ms * 1000);
+        return 0;
+    }
+
+    hotplug_arrived = 0;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    if(libusb_handle_events_timeout_completed(ctx, &tv, &hotplug_arrived) < 0) {
+        usleep(timeout_ms * 1000);
+        return 0;
+    }
+    return hotplug_arrived;
+}
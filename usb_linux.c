@@ -33,11 +33,18 @@
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
 
 #include <linux/usbdevice_fs.h>
 #include <linux/usbdevice_fs.h>
@@ -47,11 +54,19 @@
 #else
 #include <linux/usb_ch9.h>
 #endif
+#include <linux/netlink.h>
 #include <asm/byteorder.h>
 
 #include "usb.h"
 
-#define MAX_RETRIES 5
+#define MAX_RETRIES 8
+
+/* a failed read is retried after 1, 2, 4 .. 64ms, or sooner on disconnect */
+#define RETRY_BACKOFF_MIN_MS 1
+#define RETRY_BACKOFF_MAX_MS 64
+
+#define USB_DEV_ROOT "/dev/bus/usb"
+#define USB_SYSFS_ROOT "/sys/bus/usb/devices"
 
 #ifdef TRACE_USB
 #define DBG1(x...) fprintf(stderr, x)
@@ -63,17 +78,112 @@
 
 /* The max bulk size for linux is 16384 which is defined
  * in drivers/usb/core/devio.c.
+ * This is what we fall back to when the kernel can't tell us better,
+ * see probe_caps().
  */
 #define MAX_USBFS_BULK_SIZE (16 * 1024)
 
+/* Largest transfer we pick on kernels with scatter-gather, same as the
+ * Windows backend.
+ */
+#define MAX_USBFS_SG_BULK_SIZE (1024 * 1024)
+
+/* usbcore's default usbfs_memory_mb */
+#define DEFAULT_USBFS_MEMORY (16 * 1024 * 1024)
+#define USBFS_MEMORY_MB "/sys/module/usbcore/parameters/usbfs_memory_mb"
+
+/* capabilities missing from older kernel headers */
+#ifndef USBDEVFS_GET_CAPABILITIES
+#define USBDEVFS_GET_CAPABILITIES _IOR('U', 26, __u32)
+#endif
+#ifndef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+#define USBDEVFS_CAP_NO_PACKET_SIZE_LIM 0x04
+#endif
+#ifndef USBDEVFS_CAP_BULK_SCATTER_GATHER
+#define USBDEVFS_CAP_BULK_SCATTER_GATHER 0x08
+#endif
+#ifndef USBDEVFS_CAP_MMAP
+#define USBDEVFS_CAP_MMAP 0x20
+#endif
+#ifndef USBDEVFS_GET_SPEED
+#define USBDEVFS_GET_SPEED _IO('U', 31)
+#endif
+#ifndef USBDEVFS_URB_ZERO_PACKET
+#define USBDEVFS_URB_ZERO_PACKET 0x40
+#endif
+
+/* Fastboot's command buffer. A shorter write that ends on a packet
+ * boundary gets a zero-length packet, or the device would wait for more.
+ */
+#define USB_MESSAGE_SIZE 64
+
+/* Number of bulk URBs usb_write keeps queued on the OUT endpoint, so the
+ * host controller always has the next chunk ready when one completes.
+ */
+#define DEFAULT_URB_DEPTH 8
+#define MAX_URB_DEPTH 64
+
 struct usb_handle 
 {
+    /* must stay first, the transport calls cast back to the handle */
+    transport t;
+
     char fname[64];
+    /* bus and ports, to find the device again after a reset */
+    char port[64];
     int desc;
     unsigned char ep_in;
     unsigned char ep_out;
+    int ifc;
+    /* wMaxPacketSize of the OUT and IN endpoints */
+    int max_packet;
+    int in_packet;
+    /* link speed in Mbit/s, 0 if unknown */
+    int speed;
+
+    /* last read ended on a packet boundary, a ZLP may follow it */
+    int zlp_pending;
+    /* reads that aren't whole packets land here first */
+    unsigned char *bounce;
+    int bounce_size;
+
+    /* readable once usb_cancel() was called, fails all later transfers */
+    int cancel_fd;
+
+    /* read retries so far, and the time spent waiting on them */
+    unsigned retries;
+    long long stall_ms;
+
+    /* USBDEVFS_CAP_* and the transfer size picked from them */
+    unsigned caps;
+    unsigned long usbfs_memory;
+    int xfer_size;
+    /* bytes mapped from the usbfs fd, pool and buf_alloc together */
+    unsigned long mapped;
+
+    int urb_depth;
+    struct usbdevfs_urb urbs[MAX_URB_DEPTH];
+
+    /* transfer buffers of one usb_write_fill, one per URB slot; mapped
+     * from the usbfs fd when the kernel supports it so the controller
+     * DMAs straight out of them, plain heap memory otherwise.
+     */
+    int pool_size;
+    int pool_buf_size;
+    unsigned char *pool[MAX_URB_DEPTH];
+    unsigned char pool_mapped[MAX_URB_DEPTH];
 };
 
+static const transport_ops usb_ops;
+
+/* handles with the usbfs fd open, they share usbfs_memory_mb */
+static int open_handles;
+
+static void count_open(int n)
+{
+    __atomic_add_fetch(&open_handles, n, __ATOMIC_SEQ_CST);
+}
+
 static inline int badname(const char *name)
 {
     while(*name) {
@@ -82,6 +192,14 @@ static inline int badname(const char *name)
     return 0;
 }
 
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static int check(void *_desc, int len, unsigned type, int size)
 {
     unsigned char *desc = _desc;
@@ -95,8 +213,7 @@ static int check(void *_desc, int len, unsigned type, int size)
 }
 
 static int filter_usb_device(int fd, char *ptr, int len, int writable,
-                             ifc_match_func callback,
-                             int *ept_in_id, int *ept_out_id, int *ifc_id)
+                             ifc_match_func callback, usb_ifc_info *match)
 {
     struct usb_device_descriptor *dev;
     struct usb_config_descriptor *cfg;
@@ -104,7 +221,7 @@ static int filter_usb_device(int fd, char *ptr, int len, int writable,
     struct usb_endpoint_descriptor *ept;
     struct usb_ifc_info info;
     
-    int in, out;
+    int in, out, packet, in_packet;
     unsigned i;
     unsigned e;
     
@@ -120,6 +237,7 @@ static int filter_usb_device(int fd, char *ptr, int len, int writable,
     len -= cfg->bLength;
     ptr += cfg->bLength;
     
+    memset(&info, 0, sizeof(info));
     info.dev_vendor = dev->idVendor;
     info.dev_product = dev->idProduct;
     info.dev_class = dev->bDeviceClass;
@@ -169,6 +287,8 @@ static int filter_usb_device(int fd, char *ptr, int len, int writable,
         
         in = -1;
         out = -1;
+        packet = 0;
+        in_packet = 0;
         info.ifc_class = ifc->bInterfaceClass;
         info.ifc_subclass = ifc->bInterfaceSubClass;
         info.ifc_protocol = ifc->bInterfaceProtocol;
@@ -190,18 +310,23 @@ static int filter_usb_device(int fd, char *ptr, int len, int writable,
             
             if(ept->bEndpointAddress & 0x80) {
                 in = ept->bEndpointAddress;
+                in_packet = __le16_to_cpu(ept->wMaxPacketSize) & 0x7ff;
             } else {
                 out = ept->bEndpointAddress;
+                packet = __le16_to_cpu(ept->wMaxPacketSize) & 0x7ff;
             }
         }
 
         info.has_bulk_in = (in != -1);
         info.has_bulk_out = (out != -1);
+        info.ifc_number = ifc->bInterfaceNumber;
+        info.ep_in = in;
+        info.ep_out = out;
+        info.max_packet = packet;
+        info.in_packet = in_packet;
         
         if(callback(&info) == 0) {
-            *ept_in_id = in;
-            *ept_out_id = out;
-            *ifc_id = ifc->bInterfaceNumber;
+            *match = info;
             return 0;
         }
     }
@@ -209,12 +334,246 @@ static int filter_usb_device(int fd, char *ptr, int len, int writable,
     return -1;
 }
 
-static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
+static unsigned long read_usbfs_memory(void)
+{
+    char buf[32];
+    unsigned long mb;
+    int fd, n;
+
+    fd = open(USBFS_MEMORY_MB, O_RDONLY);
+    if(fd < 0) return DEFAULT_USBFS_MEMORY;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0) return DEFAULT_USBFS_MEMORY;
+    buf[n] = 0;
+
+    /* 0 means usbfs memory isn't limited */
+    mb = strtoul(buf, 0, 10);
+    return mb ? mb * 1024 * 1024 : ~0UL;
+}
+
+/* This handle's share of half the usbfs memory budget, split between
+ * all open handles; the other half is left to mapped buffers and other
+ * usbfs users.
+ */
+static unsigned long handle_budget(usb_handle *h)
+{
+    int n = __atomic_load_n(&open_handles, __ATOMIC_SEQ_CST);
+
+    return h->usbfs_memory / 2 / (n > 1 ? n : 1);
+}
+
+/* Largest transfer the kernel will take that still lets the whole URB
+ * queue fit in the handle's budget. Without scatter-gather usbfs needs
+ * one physically contiguous buffer per URB, so we stay at the old 16 KB.
+ * Picked again for each transfer, as devices come and go.
+ */
+static void pick_xfer_size(usb_handle *h)
+{
+    unsigned long size = MAX_USBFS_BULK_SIZE;
+
+    if(h->caps & USBDEVFS_CAP_BULK_SCATTER_GATHER) {
+        size = handle_budget(h) / h->urb_depth;
+        if(size > MAX_USBFS_SG_BULK_SIZE) size = MAX_USBFS_SG_BULK_SIZE;
+        if(size < MAX_USBFS_BULK_SIZE) size = MAX_USBFS_BULK_SIZE;
+    }
+
+    /* whole packets only, so a short packet ends just the last transfer */
+    if(h->max_packet > 0)
+        size -= size % h->max_packet;
+
+    h->xfer_size = size;
+    h->t.max_xfer = size;
+}
+
+/* Ask usbfs what it can do (Linux 3.15+), older kernels keep caps at 0
+ * and therefore the historic 16 KB transfers.
+ */
+static void probe_caps(usb_handle *h)
+{
+    __u32 caps = 0;
+
+    if(ioctl(h->desc, USBDEVFS_GET_CAPABILITIES, &caps) != 0)
+        caps = 0;
+    h->caps = caps;
+    h->usbfs_memory = read_usbfs_memory();
+    pick_xfer_size(h);
+
+    DBG("[ usbfs caps 0x%x, memory %lu, max packet %d/%d, xfer %d ]\n",
+        h->caps, h->usbfs_memory, h->max_packet, h->in_packet, h->xfer_size);
+}
+
+/* Ask usbfs for the link speed (Linux 3.2+), in Mbit/s. */
+static int probe_speed(int fd)
+{
+    switch(ioctl(fd, USBDEVFS_GET_SPEED)) {
+    case 1: return 1;           /* low speed, really 1.5 */
+    case 2: return 12;
+    case 3: return 480;
+    case 4: return 480;         /* wireless */
+    case 5: return 5000;
+    case 6: return 10000;
+    default: return 0;
+    }
+}
+
+/* bulk wMaxPacketSize fixed by the spec, for descriptors that lack one */
+static int speed_packet(int speed)
+{
+    if(speed >= 5000) return 1024;
+    if(speed >= 480) return 512;
+    return 64;
+}
+
+/* Take over interface @ifc of the device open on @fd. On failure the fd
+ * is closed.
+ */
+static usb_handle *claim_usb_device(int fd, const char *devname,
+                                    int in, int out, int ifc, int packet,
+                                    int in_packet)
+{
+    usb_handle *usb;
+
+    usb = calloc(1, sizeof(usb_handle));
+    if(usb == 0 || ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifc) != 0) {
+        close(fd);
+        free(usb);
+        return 0;
+    }
+
+    if(snprintf(usb->fname, sizeof(usb->fname), "%s", devname) >=
+       (int) sizeof(usb->fname)) {
+        close(fd);
+        free(usb);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    usb->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(usb->cancel_fd < 0) {
+        close(fd);
+        free(usb);
+        return 0;
+    }
+
+    usb->ep_in = in;
+    usb->ep_out = out;
+    usb->ifc = ifc;
+    usb->desc = fd;
+    count_open(1);
+    usb->speed = probe_speed(fd);
+    usb->max_packet = packet ? packet : speed_packet(usb->speed);
+    usb->in_packet = in_packet ? in_packet : speed_packet(usb->speed);
+    usb->urb_depth = DEFAULT_URB_DEPTH;
+    usb->t.ops = &usb_ops;
+    usb->t.flags = TRANSPORT_ASYNC;
+    probe_caps(usb);
+    if(usb->caps & USBDEVFS_CAP_MMAP)
+        usb->t.flags |= TRANSPORT_ZERO_COPY;
+
+    return usb;
+}
+
+/* read a sysfs attribute, without the trailing newline */
+static int read_sysfs(const char *dir, const char *attr, char *buf, int size)
+{
+    char path[PATH_MAX];
+    int fd, n;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if(n < 0) return -1;
+
+    while(n > 0 && buf[n - 1] == '\n') n--;
+    buf[n] = 0;
+    return n;
+}
+
+static int read_sysfs_num(const char *dir, const char *attr, int base,
+                          unsigned *val)
+{
+    char buf[32];
+    char *end;
+
+    if(read_sysfs(dir, attr, buf, sizeof(buf)) <= 0) return -1;
+    *val = strtoul(buf, &end, base);
+    return (*end == 0) ? 0 : -1;
+}
+
+/* find the bulk endpoints of the interface at sysfs path @ifcdir */
+static void sysfs_endpoints(const char *ifcdir, int *in, int *out,
+                            int *packet, int *in_packet)
+{
+    char epdir[PATH_MAX];
+    char type[16];
+    unsigned addr, size;
+    DIR *dir;
+    struct dirent *de;
+
+    *in = -1;
+    *out = -1;
+    *packet = 0;
+    *in_packet = 0;
+
+    dir = opendir(ifcdir);
+    if(dir == 0) return;
+
+    while((de = readdir(dir))) {
+        if(strncmp(de->d_name, "ep_", 3)) continue;
+        if(snprintf(epdir, sizeof(epdir), "%s/%s", ifcdir, de->d_name) >=
+           (int) sizeof(epdir))
+            continue;
+
+        if(read_sysfs(epdir, "type", type, sizeof(type)) < 0 ||
+           strcmp(type, "Bulk"))
+            continue;
+        if(read_sysfs_num(epdir, "bEndpointAddress", 16, &addr))
+            continue;
+        if(addr & 0x80) {
+            *in = addr;
+            if(read_sysfs_num(epdir, "wMaxPacketSize", 16, &size) == 0)
+                *in_packet = size & 0x7ff;
+        } else {
+            *out = addr;
+            if(read_sysfs_num(epdir, "wMaxPacketSize", 16, &size) == 0)
+                *packet = size & 0x7ff;
+        }
+    }
+    closedir(dir);
+}
+
+/* interfaces accepted by the match callback during one scan */
+struct ifc_list
+{
+    usb_ifc_info *items;
+    int count;
+    int size;
+};
+
+static int add_ifc(struct ifc_list *list, const usb_ifc_info *info)
+{
+    usb_ifc_info *items;
+
+    if(list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 4;
+        items = realloc(list->items, list->size * sizeof(*items));
+        if(items == 0) return -1;
+        list->items = items;
+    }
+    list->items[list->count++] = *info;
+    return 0;
+}
+
+static int scan_usbfs(const char *base, ifc_match_func callback,
+                      struct ifc_list *list)
 {
-    usb_handle *usb = 0;
     char busname[64], devname[64];
     char desc[2048];
-    int n, in, out, ifc;
+    usb_ifc_info info;
+    int n;
     
     DIR *busdir, *devdir;
     struct dirent *de;
@@ -222,9 +581,9 @@ static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
     int writable;
     
     busdir = opendir(base);
-    if(busdir == 0) return 0;
+    if(busdir == 0) return -1;
 
-    while((de = readdir(busdir)) && (usb == 0)) {
+    while((de = readdir(busdir))) {
         if(badname(de->d_name)) continue;
         
         sprintf(busname, "%s/%s", base, de->d_name);
@@ -232,7 +591,7 @@ static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
         if(devdir == 0) continue;
         
 //        DBG("[ scanning %s ]\n", busname);
-        while((de = readdir(devdir)) && (usb == 0)) {
+        while((de = readdir(devdir))) {
             
             if(badname(de->d_name)) continue;
             sprintf(devname, "%s/%s", busname, de->d_name);
@@ -251,54 +610,502 @@ static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
             n = read(fd, desc, sizeof(desc));
             
             if(filter_usb_device(fd, desc, n, writable, callback,
-                                 &in, &out, &ifc) == 0) {
-                usb = calloc(1, sizeof(usb_handle));
-                strcpy(usb->fname, devname);
-                usb->ep_in = in;
-                usb->ep_out = out;
-                usb->desc = fd;
-
-                n = ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifc);
-                if(n != 0) {
-                    close(fd);
-                    free(usb);
-                    usb = 0;
-                    continue;
-                }
-            } else {
-                close(fd);
+                                 &info) == 0) {
+                strcpy(info.device_path, devname);
+                add_ifc(list, &info);
             }
+            close(fd);
         }
         closedir(devdir);
     }
     closedir(busdir);
 
-    return usb;
+    return 0;
 }
 
-int usb_write(usb_handle *h, const void *_data, int len)
+/* Match the interfaces of the device @name ("1-2.3") in sysfs directory
+ * @base, from the descriptors sysfs already caches, so no device node is
+ * opened and no GET_DESCRIPTOR request is sent to anything.
+ */
+static int sysfs_device(const char *base, const char *name,
+                        ifc_match_func callback, struct ifc_list *list)
+{
+    char devdir[PATH_MAX], ifcdir[PATH_MAX], devname[64];
+    struct usb_ifc_info info;
+    unsigned val, busnum, devnum, ifc;
+    int len, in, out, packet, in_packet;
+    DIR *dir;
+    struct dirent *ifde;
+
+    snprintf(devdir, sizeof(devdir), "%s/%s", base, name);
+
+    memset(&info, 0, sizeof(info));
+    if(read_sysfs_num(devdir, "idVendor", 16, &val)) return -1;
+    info.dev_vendor = val;
+    if(read_sysfs_num(devdir, "idProduct", 16, &val)) return -1;
+    info.dev_product = val;
+    if(read_sysfs_num(devdir, "bDeviceClass", 16, &val)) return -1;
+    info.dev_class = val;
+    if(read_sysfs_num(devdir, "bDeviceSubClass", 16, &val)) return -1;
+    info.dev_subclass = val;
+    if(read_sysfs_num(devdir, "bDeviceProtocol", 16, &val)) return -1;
+    info.dev_protocol = val;
+    if(read_sysfs_num(devdir, "busnum", 10, &busnum) ||
+       read_sysfs_num(devdir, "devnum", 10, &devnum))
+        return -1;
+    if(read_sysfs(devdir, "serial", info.serial_number,
+                  sizeof(info.serial_number)) < 0)
+        info.serial_number[0] = 0;
+    snprintf(info.port_path, sizeof(info.port_path), "%s", name);
+
+    sprintf(devname, "%s/%03u/%03u", USB_DEV_ROOT, busnum, devnum);
+    if(access(devname, R_OK)) return -1;
+    info.writable = !access(devname, R_OK | W_OK);
+
+    /* interfaces of the active configuration are "<dev>:<cfg>.<ifc>" */
+    dir = opendir(devdir);
+    if(dir == 0) return -1;
+    len = strlen(name);
+    while((ifde = readdir(dir))) {
+        if(strncmp(ifde->d_name, name, len) || ifde->d_name[len] != ':')
+            continue;
+        if(snprintf(ifcdir, sizeof(ifcdir), "%s/%s", devdir, ifde->d_name) >=
+           (int) sizeof(ifcdir))
+            continue;
+
+        if(read_sysfs_num(ifcdir, "bInterfaceClass", 16, &val)) continue;
+        info.ifc_class = val;
+        if(read_sysfs_num(ifcdir, "bInterfaceSubClass", 16, &val)) continue;
+        info.ifc_subclass = val;
+        if(read_sysfs_num(ifcdir, "bInterfaceProtocol", 16, &val)) continue;
+        info.ifc_protocol = val;
+        if(read_sysfs_num(ifcdir, "bInterfaceNumber", 16, &ifc)) continue;
+
+        sysfs_endpoints(ifcdir, &in, &out, &packet, &in_packet);
+        info.has_bulk_in = (in != -1);
+        info.has_bulk_out = (out != -1);
+        info.ifc_number = ifc;
+        info.ep_in = in;
+        info.ep_out = out;
+        info.max_packet = packet;
+        info.in_packet = in_packet;
+        strcpy(info.device_path, devname);
+
+        if(callback(&info) != 0) continue;
+
+        DBG("[ sysfs match %s at %s ]\n", ifde->d_name, devname);
+        add_ifc(list, &info);
+        break;
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+static int scan_sysfs(const char *base, ifc_match_func callback,
+                      struct ifc_list *list)
+{
+    DIR *root;
+    struct dirent *de;
+
+    root = opendir(base);
+    if(root == 0) return -1;
+
+    while((de = readdir(root))) {
+        /* devices only, interfaces are handled by sysfs_device */
+        if(de->d_name[0] == '.' || strchr(de->d_name, ':')) continue;
+        sysfs_device(base, de->d_name, callback, list);
+    }
+    closedir(root);
+
+    return 0;
+}
+
+void usb_set_queue_depth(usb_handle *h, int depth)
+{
+    if(depth < 1) depth = 1;
+    if(depth > MAX_URB_DEPTH) depth = MAX_URB_DEPTH;
+    h->urb_depth = depth;
+    pick_xfer_size(h);
+}
+
+int usb_get_xfer_info(usb_handle *h, usb_xfer_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->xfer_size = h->xfer_size;
+    info->queue_depth = h->urb_depth;
+    info->max_packet = h->max_packet;
+    info->in_packet = h->in_packet;
+    info->speed = h->speed;
+    info->zero_copy = !!(h->caps & USBDEVFS_CAP_MMAP);
+    info->scatter_gather = !!(h->caps & USBDEVFS_CAP_BULK_SCATTER_GATHER);
+    info->no_packet_size_lim = !!(h->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM);
+    info->retries = h->retries;
+    info->stall_ms = h->stall_ms;
+    return 0;
+}
+
+/* Wait for a discarded URB to come back. */
+static struct usbdevfs_urb *reap_urb(usb_handle *h)
+{
+    struct usbdevfs_urb *urb = 0;
+
+    for(;;) {
+        if(ioctl(h->desc, USBDEVFS_REAPURB, &urb) == 0)
+            return urb;
+        if(errno != EINTR)
+            return 0;
+    }
+}
+
+/* Wait for the oldest in-flight URB, until @deadline (0: forever) or the
+ * handle is cancelled, failing with ETIMEDOUT or ECANCELED then. URBs on
+ * one endpoint complete in submission order, so the reaped URB is always
+ * the oldest one.
+ */
+static struct usbdevfs_urb *wait_urb(usb_handle *h, long long deadline)
+{
+    struct usbdevfs_urb *urb = 0;
+    struct pollfd pfd[2];
+    int timeout;
+
+    for(;;) {
+        if(ioctl(h->desc, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+            return urb;
+        if(errno != EAGAIN && errno != EINTR)
+            return 0;
+
+        timeout = -1;
+        if(deadline) {
+            timeout = deadline - now_ms();
+            if(timeout < 0) timeout = 0;
+        }
+
+        /* usbfs reports completed URBs as writable */
+        pfd[0].fd = h->desc;
+        pfd[0].events = POLLOUT;
+        pfd[1].fd = h->cancel_fd;
+        pfd[1].events = POLLIN;
+        if(poll(pfd, 2, timeout) < 0 && errno != EINTR)
+            return 0;
+
+        if(pfd[1].revents & POLLIN) {
+            errno = ECANCELED;
+            return 0;
+        }
+        if(pfd[0].revents & (POLLERR | POLLHUP)) {
+            errno = ENODEV;
+            return 0;
+        }
+        if(deadline && !(pfd[0].revents & POLLOUT) && now_ms() >= deadline) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+    }
+}
+
+/* Discard and reap everything still queued after a failed transfer. */
+static void cancel_urbs(usb_handle *h, int tail, int inflight)
+{
+    int i;
+
+    for(i = 0; i < inflight; i++)
+        ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urbs[(tail + i) % h->urb_depth]);
+    while(inflight-- > 0)
+        reap_urb(h);
+}
+
+/* A stalled endpoint refuses all URBs until the halt is cleared. */
+static int clear_halt(usb_handle *h, unsigned char ep)
+{
+    unsigned int e = ep;
+
+    if(ioctl(h->desc, USBDEVFS_CLEAR_HALT, &e) != 0) {
+        DBG("ERROR: clear halt on ep 0x%02x, errno = %d (%s)\n",
+            ep, errno, strerror(errno));
+        return -1;
+    }
+    DBG("[ cleared halt on ep 0x%02x ]\n", ep);
+    return 0;
+}
+
+/* Send one URB and wait for it, returns the bytes transferred. */
+static int single_urb(usb_handle *h, unsigned char ep, void *data, int len,
+                      unsigned flags, long long deadline)
+{
+    struct usbdevfs_urb *urb = &h->urbs[0];
+    int n;
+
+    memset(urb, 0, sizeof(*urb));
+    urb->type = USBDEVFS_URB_TYPE_BULK;
+    urb->endpoint = ep;
+    urb->buffer = data;
+    urb->buffer_length = len;
+    urb->flags = flags;
+
+    if(ioctl(h->desc, USBDEVFS_SUBMITURB, urb) != 0)
+        return -1;
+
+    if(wait_urb(h, deadline) == 0) {
+        n = errno;
+        cancel_urbs(h, 0, 1);
+        errno = n;
+        return -1;
+    }
+
+    if(urb->status != 0) {
+        if(urb->status == -EPIPE)
+            clear_halt(h, ep);
+        errno = -urb->status;
+        return -1;
+    }
+    return urb->actual_length;
+}
+
+/* Map @len bytes from the usbfs fd, if the kernel can and they fit in
+ * the handle's budget; 0 otherwise.
+ */
+static void *map_buf(usb_handle *h, unsigned len)
+{
+    void *buf;
+
+    if(h->desc < 0 || !(h->caps & USBDEVFS_CAP_MMAP)) return 0;
+    if(h->mapped + len > handle_budget(h)) return 0;
+    buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, h->desc, 0);
+    if(buf == MAP_FAILED) return 0;
+    h->mapped += len;
+    return buf;
+}
+
+static void unmap_buf(usb_handle *h, void *buf, unsigned len)
+{
+    munmap(buf, len);
+    h->mapped -= len;
+}
+
+static void free_pool(usb_handle *h)
+{
+    int i;
+
+    for(i = 0; i < h->pool_size; i++) {
+        if(h->pool_mapped[i])
+            unmap_buf(h, h->pool[i], h->pool_buf_size);
+        else
+            free(h->pool[i]);
+        h->pool[i] = 0;
+    }
+    h->pool_size = 0;
+}
+
+/* Give every URB slot its own transfer buffer, for one transfer. Buffers
+ * mapped from the usbfs fd (USBDEVFS_CAP_MMAP, Linux 4.6+) are used by
+ * the kernel in place; otherwise, or past the handle's budget, we fall
+ * back to heap buffers, which usbfs copies.
+ */
+static int alloc_pool(usb_handle *h)
+{
+    void *buf;
+
+    h->pool_buf_size = h->xfer_size;
+    while(h->pool_size < h->urb_depth) {
+        buf = map_buf(h, h->pool_buf_size);
+        if(buf) {
+            h->pool_mapped[h->pool_size] = 1;
+        } else {
+            buf = malloc(h->pool_buf_size);
+            if(buf == 0) return -1;
+            h->pool_mapped[h->pool_size] = 0;
+        }
+        DBG("[ urb buffer %d %s ]\n", h->pool_size,
+            h->pool_mapped[h->pool_size] ? "zero-copy" : "copied");
+        h->pool[h->pool_size++] = buf;
+    }
+
+    return 0;
+}
+
+/* Stream @len bytes to the OUT endpoint through the URB queue. The bytes
+ * come from @data, which is submitted in place, from @fill, which
+ * produces each chunk straight into a pool buffer, or from @src, whose
+ * pieces are submitted where they lie and released as their URBs come
+ * back, so the queue runs on across the source's own chunks.
+ */
+static int queue_out(usb_handle *h, const unsigned char *data,
+                     usb_fill_func fill, void *cookie,
+                     const transport_source *src, int len,
+                     long long deadline, int *done)
 {
-    unsigned char *data = (unsigned char*) _data;
-    /* unmmap transfered memory */
-    unsigned char *addr = _data;
-    int page_size = 0;
-    int free_len = 0;
-    int freed_size = 0;
     unsigned count = 0;
-    struct usbdevfs_bulktransfer bulk;
+    unsigned submitted = 0;
+    int head = 0, tail = 0, inflight = 0;
+    struct usbdevfs_urb *urb;
     int n;
 
+    while(count < (unsigned) len) {
+        /* keep the queue full */
+        while(inflight < h->urb_depth && submitted < (unsigned) len) {
+            int xfer = len - submitted;
+            if(xfer > h->xfer_size) xfer = h->xfer_size;
+
+            urb = &h->urbs[head];
+            memset(urb, 0, sizeof(*urb));
+            urb->type = USBDEVFS_URB_TYPE_BULK;
+            urb->endpoint = h->ep_out;
+            urb->buffer_length = xfer;
+
+            if(data) {
+                urb->buffer = (void*) (data + submitted);
+            } else if(src) {
+                const void *piece;
+
+                /* only wait for the source with nothing left to reap */
+                n = src->next(src->cookie, &piece, xfer, inflight == 0);
+                if(n < 0) {
+                    n = errno ? errno : EIO;
+                    DBG("ERROR: source of %d bytes failed\n", xfer);
+                    cancel_urbs(h, tail, inflight);
+                    errno = n;
+                    return -1;
+                }
+                if(n == 0) break;
+                xfer = n;
+                urb->buffer = (void*) piece;
+                urb->buffer_length = xfer;
+            } else {
+                urb->buffer = h->pool[head];
+                if(fill(cookie, urb->buffer, xfer) != xfer) {
+                    n = errno ? errno : EIO;
+                    DBG("ERROR: fill of %d bytes failed\n", xfer);
+                    cancel_urbs(h, tail, inflight);
+                    errno = n;
+                    return -1;
+                }
+            }
+
+            if(ioctl(h->desc, USBDEVFS_SUBMITURB, urb) != 0) {
+                n = errno;
+                DBG("ERROR: submit urb failed, errno = %d (%s)\n",
+                    n, strerror(n));
+                cancel_urbs(h, tail, inflight);
+                errno = n;
+                return -1;
+            }
+
+            submitted += xfer;
+            head = (head + 1) % h->urb_depth;
+            inflight++;
+        }
+
+        urb = wait_urb(h, deadline);
+        if(urb == 0) {
+            n = errno;
+            DBG("ERROR: reap urb failed, errno = %d (%s)\n", n, strerror(n));
+            cancel_urbs(h, tail, inflight);
+            errno = n;
+            return -1;
+        }
+        tail = (tail + 1) % h->urb_depth;
+        inflight--;
+
+        if(urb->status != 0 || urb->actual_length != urb->buffer_length) {
+            DBG("ERROR: urb status = %d, %d of %d bytes\n", urb->status,
+                urb->actual_length, urb->buffer_length);
+            if(done) *done = count + urb->actual_length;
+            n = urb->status;
+            cancel_urbs(h, tail, inflight);
+            if(n == -EPIPE)
+                clear_halt(h, h->ep_out);
+            errno = n ? -n : EIO;
+            return -1;
+        }
+
+        if(src) src->release(src->cookie, urb->actual_length);
+        count += urb->actual_length;
+        if(done) *done = count;
+    }
+
+    return count;
+}
+
+/* The pool a fill writes into only lives for the transfer, so idle
+ * handles hold no usbfs memory.
+ */
+static int bulk_out(usb_handle *h, const unsigned char *data,
+                    usb_fill_func fill, void *cookie,
+                    const transport_source *src, int len,
+                    long long deadline, int *done)
+{
+    int r, n;
+
+    pick_xfer_size(h);
+    if(fill && alloc_pool(h)) {
+        free_pool(h);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    r = queue_out(h, data, fill, cookie, src, len, deadline, done);
+
+    n = errno;
+    free_pool(h);
+    errno = n;
+    return r;
+}
+
+/* Sleep @ms before retrying a failed read. Wakes early with ENODEV if the
+ * device goes away, or ECANCELED/ETIMEDOUT like wait_urb().
+ */
+static int backoff(usb_handle *h, int ms, long long deadline)
+{
+    struct pollfd pfd[2];
+    int left;
+
+    if(deadline) {
+        left = deadline - now_ms();
+        if(left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(ms > left) ms = left;
+    }
+
+    /* nothing is in flight, so the usbfs fd only reports a disconnect */
+    pfd[0].fd = h->desc;
+    pfd[0].events = 0;
+    pfd[1].fd = h->cancel_fd;
+    pfd[1].events = POLLIN;
+    if(poll(pfd, 2, ms) <= 0)
+        return 0;
+
+    if(pfd[1].revents & POLLIN) {
+        errno = ECANCELED;
+        return -1;
+    }
+    if(pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        errno = ENODEV;
+        return -1;
+    }
+    return 0;
+}
+
+static long long deadline_of(int timeout_ms)
+{
+    return timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+}
+
+int usb_write_timeout(usb_handle *h, const void *_data, int len,
+                      int timeout_ms, int *done)
+{
+    long long deadline = deadline_of(timeout_ms);
+    int n;
+
+    if(done) *done = 0;
     if(h->ep_out == 0) {
         return -1;
     }
     
     if(len == 0) {
-        bulk.ep = h->ep_out;
-        bulk.len = 0;
-        bulk.data = data;
-        bulk.timeout = 0;
-        
-        n = ioctl(h->desc, USBDEVFS_BULK, &bulk);
+        n = single_urb(h, h->ep_out, (void*) _data, 0, 0, deadline);
         if(n != 0) {
             fprintf(stderr,"ERROR: n = %d, errno = %d (%s)\n",
                     n, errno, strerror(errno));
@@ -306,89 +1113,144 @@ int usb_write(usb_handle *h, const void *_data, int len)
         }
         return 0;
     }
-    
-    page_size = sysconf(_SC_PAGE_SIZE);
-    if (page_size == -1) {
-        DBG("ERROR: can not get system page size\n");
-    } else {
-        /*
-         * according to munmap(2)
-         * It is not an error if the indicated range does not contain any mapped pages.
-         * we'll limit the size to 10MB
-         */
-#define MUNMAP_SIZE (10 * 1024 * 1024)
-        free_len = MUNMAP_SIZE - MUNMAP_SIZE % page_size;
-    }
 
-    while(len > 0) {
-        int xfer;
-        xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
-        
-        bulk.ep = h->ep_out;
-        bulk.len = xfer;
-        bulk.data = data;
-        bulk.timeout = 0;
-        
-        n = ioctl(h->desc, USBDEVFS_BULK, &bulk);
-        if(n != xfer) {
-            DBG("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
-        }
+    return bulk_out(h, _data, 0, 0, 0, len, deadline, done);
+}
+
+/* A command the device can't tell is complete without a ZLP. Data phases
+ * never get one, their size is known and a piece of one ending on a
+ * packet boundary must not end it.
+ */
+static int usb_write_message(usb_handle *h, const void *data, int len,
+                             int timeout_ms, int *done)
+{
+    int n;
 
-        count += xfer;
-        len -= xfer;
-        data += xfer;
+    if(len == 0 || len >= USB_MESSAGE_SIZE || len % h->max_packet ||
+       h->ep_out == 0)
+        return usb_write_timeout(h, data, len, timeout_ms, done);
 
-        if (count - freed_size >= free_len) {
-            if (munmap(addr, free_len)) {
-                DBG("ERROR: munmap failed: %m\n");
-                continue;
-            }
-            freed_size += free_len;
-            addr += free_len;
-        }
+    if(done) *done = 0;
+    n = single_urb(h, h->ep_out, (void*) data, len,
+                   USBDEVFS_URB_ZERO_PACKET, deadline_of(timeout_ms));
+    if(n >= 0 && done) *done = n;
+    return n;
+}
+
+int usb_write(usb_handle *h, const void *_data, int len)
+{
+    return usb_write_timeout(h, _data, len, 0, 0);
+}
+
+int usb_write_fill_timeout(usb_handle *h, usb_fill_func fill, void *cookie,
+                           int len, int timeout_ms, int *done)
+{
+    if(done) *done = 0;
+    if(h->ep_out == 0) {
+        return -1;
     }
 
-    return count;
+    if(len == 0) {
+        return usb_write_timeout(h, 0, 0, timeout_ms, 0);
+    }
+
+    return bulk_out(h, 0, fill, cookie, 0, len, deadline_of(timeout_ms),
+                    done);
 }
 
-int usb_read(usb_handle *h, void *_data, int len)
+int usb_write_fill(usb_handle *h, usb_fill_func fill, void *cookie, int len)
+{
+    return usb_write_fill_timeout(h, fill, cookie, len, 0, 0);
+}
+
+int usb_read_timeout(usb_handle *h, void *_data, int len,
+                     int timeout_ms, int *done)
 {
     unsigned char *data = (unsigned char*) _data;
+    long long deadline = deadline_of(timeout_ms);
+    int backoff_ms = RETRY_BACKOFF_MIN_MS;
+    long long stall;
     unsigned count = 0;
-    struct usbdevfs_bulktransfer bulk;
-    int n, retry;
+    unsigned char *buf;
+    int n, retry, urb_len;
 
+    if(done) *done = 0;
     if(h->ep_in == 0) {
         return -1;
     }
+    pick_xfer_size(h);
     
     while(len > 0) {
-        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
+        int xfer = (len > h->xfer_size) ? h->xfer_size : len;
         
-        bulk.ep = h->ep_in;
-        bulk.len = xfer;
-        bulk.data = data;
-        bulk.timeout = 0;
         retry = 0;
+        stall = 0;
+
+        /* the device may send a whole packet whatever we ask for, so
+         * a partial packet is read into the bounce buffer */
+        if(xfer % h->in_packet) {
+            urb_len = xfer + h->in_packet - xfer % h->in_packet;
+            if(urb_len > h->bounce_size) {
+                free(h->bounce);
+                h->bounce = malloc(urb_len);
+                h->bounce_size = h->bounce ? urb_len : 0;
+                if(h->bounce == 0) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+            }
+            buf = h->bounce;
+        } else {
+            urb_len = xfer;
+            buf = data;
+        }
 
         do{
            DBG("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
-           n = ioctl(h->desc, USBDEVFS_BULK, &bulk);
+           n = single_urb(h, h->ep_in, buf, urb_len, 0, deadline);
+           /* the ZLP ending the previous message, not this one */
+           if(n == 0 && count == 0 && h->zlp_pending) {
+               h->zlp_pending = 0;
+               n = single_urb(h, h->ep_in, buf, urb_len, 0, deadline);
+           }
            DBG("[ usb read %d ] = %d, fname=%s, Retry %d \n", xfer, n, h->fname, retry);
 
            if( n < 0 ) {
             DBG1("ERROR: n = %d, errno = %d (%s)\n",n, errno, strerror(errno));
-            if ( ++retry > MAX_RETRIES ) return -1;
-            sleep( 1 );
+            /* out of time, or nothing left to retry on */
+            if (errno == ETIMEDOUT || errno == ECANCELED || errno == ENODEV)
+                break;
+            if ( ++retry > MAX_RETRIES ) break;
+            if ( !stall ) stall = now_ms();
+            h->retries++;
+            if ( backoff(h, backoff_ms, deadline) ) break;
+            if ( backoff_ms < RETRY_BACKOFF_MAX_MS ) backoff_ms *= 2;
            }
         }
         while( n < 0 );
 
+        if( stall ) {
+            h->stall_ms += now_ms() - stall;
+        }
+        if( n < 0 ) {
+            return -1;
+        }
+        /* a short read that ends on a packet boundary was ended by a ZLP */
+        h->zlp_pending = (n == urb_len && n % h->in_packet == 0);
+
+        if(buf != data) {
+            if(n > xfer) {
+                DBG("ERROR: %d bytes for a %d byte read\n", n, xfer);
+                errno = EOVERFLOW;
+                return -1;
+            }
+            memcpy(data, buf, n);
+        }
+
         count += n;
         len -= n;
         data += n;
+        if(done) *done = count;
         
         if(n < xfer) {
             break;
@@ -398,6 +1260,174 @@ int usb_read(usb_handle *h, void *_data, int len)
     return count;
 }
 
+int usb_read(usb_handle *h, void *_data, int len)
+{
+    return usb_read_timeout(h, _data, len, 0, 0);
+}
+
+void usb_cancel(usb_handle *h)
+{
+    eventfd_write(h->cancel_fd, 1);
+}
+
+/* Open the device node and claim our interface. The node is looked up
+ * by port when that is known, a device that came back from a reset as a
+ * new device has a new one.
+ */
+static int open_node(usb_handle *h)
+{
+    char devdir[PATH_MAX];
+    unsigned busnum, devnum;
+    int fd;
+
+    if(h->port[0]) {
+        snprintf(devdir, sizeof(devdir), "%s/%s", USB_SYSFS_ROOT, h->port);
+        if(read_sysfs_num(devdir, "busnum", 10, &busnum) ||
+           read_sysfs_num(devdir, "devnum", 10, &devnum)) {
+            errno = ENODEV;
+            return -1;
+        }
+        snprintf(h->fname, sizeof(h->fname), "%s/%03u/%03u", USB_DEV_ROOT,
+                 busnum, devnum);
+    }
+
+    fd = open(h->fname, O_RDWR);
+    if(fd < 0) return -1;
+    if(ioctl(fd, USBDEVFS_CLAIMINTERFACE, &h->ifc) != 0) {
+        close(fd);
+        return -1;
+    }
+    h->desc = fd;
+    count_open(1);
+    return 0;
+}
+
+/* how long a reset device gets to show up on its port again */
+#define RESET_FIND_TRIES 20
+#define RESET_FIND_MS 100
+
+int usb_recover(usb_handle *h, int hard)
+{
+    int i;
+
+    /* the protocol closes the link on errors, take it back first */
+    if(h->desc < 0 && open_node(h))
+        return -1;
+    if(h->cancel_fd < 0) {
+        h->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(h->cancel_fd < 0) return -1;
+    }
+
+    if(!hard) {
+        if(clear_halt(h, h->ep_out) == 0 && clear_halt(h, h->ep_in) == 0)
+            return 0;
+    }
+
+    /* last resort, also puts the device's protocol back at a command */
+    DBG("[ resetting %s ]\n", h->fname);
+    if(ioctl(h->desc, USBDEVFS_RESET, 0) != 0 && errno != ENODEV)
+        return -1;
+
+    /* the reset unbinds us from the interface, and a device whose
+     * descriptors changed comes back as a new one on the same port */
+    free_pool(h);
+    close(h->desc);
+    count_open(-1);
+    h->desc = -1;
+    h->zlp_pending = 0;
+    for(i = 0; ; i++) {
+        if(open_node(h) == 0) return 0;
+        if(i + 1 >= RESET_FIND_TRIES) return -1;
+        poll(NULL, 0, RESET_FIND_MS);
+    }
+}
+
+static int usb_t_read(transport *t, void *data, int len,
+                      int timeout_ms, int *done)
+{
+    return usb_read_timeout((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write(transport *t, const void *data, int len,
+                       int timeout_ms, int *done)
+{
+    return usb_write_timeout((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write_message(transport *t, const void *data, int len,
+                               int timeout_ms, int *done)
+{
+    return usb_write_message((usb_handle*) t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write_fill(transport *t, transport_fill_func fill,
+                            void *cookie, int len, int timeout_ms, int *done)
+{
+    return usb_write_fill_timeout((usb_handle*) t, fill, cookie, len,
+                                  timeout_ms, done);
+}
+
+static int usb_t_write_next(transport *t, const transport_source *src,
+                            int len, int timeout_ms, int *done)
+{
+    usb_handle *h = (usb_handle*) t;
+
+    if(done) *done = 0;
+    if(h->ep_out == 0) {
+        return -1;
+    }
+    if(len == 0) {
+        return usb_write_timeout(h, 0, 0, timeout_ms, 0);
+    }
+
+    return bulk_out(h, 0, 0, 0, src, len, deadline_of(timeout_ms), done);
+}
+
+static int usb_t_close(transport *t)
+{
+    return usb_close((usb_handle*) t);
+}
+
+static void usb_t_cancel(transport *t)
+{
+    usb_cancel((usb_handle*) t);
+}
+
+static int usb_t_recover(transport *t, int hard)
+{
+    return usb_recover((usb_handle*) t, hard);
+}
+
+/* mapped from the usbfs fd, URBs pointing into it are not copied */
+static void *usb_t_buf_alloc(transport *t, unsigned len)
+{
+    return map_buf((usb_handle*) t, len);
+}
+
+static void usb_t_buf_free(transport *t, void *buf, unsigned len)
+{
+    unmap_buf((usb_handle*) t, buf, len);
+}
+
+static const transport_ops usb_ops = {
+    .name = "usbfs",
+    .read = usb_t_read,
+    .write = usb_t_write,
+    .write_fill = usb_t_write_fill,
+    .write_message = usb_t_write_message,
+    .write_next = usb_t_write_next,
+    .close = usb_t_close,
+    .cancel = usb_t_cancel,
+    .recover = usb_t_recover,
+    .buf_alloc = usb_t_buf_alloc,
+    .buf_free = usb_t_buf_free,
+};
+
+transport *usb_transport(usb_handle *h)
+{
+    return &h->t;
+}
+
 void usb_kick(usb_handle *h)
 {
     int fd;
@@ -406,6 +1436,7 @@ void usb_kick(usb_handle *h)
     h->desc = -1;
     if(fd >= 0) {
         close(fd);
+        count_open(-1);
         DBG("[ usb closed %d ]\n", fd);
     }
 }
@@ -414,17 +1445,235 @@ int usb_close(usb_handle *h)
 {
     int fd;
     
+    /* usbfs mappings must go before the fd does */
+    free_pool(h);
+    free(h->bounce);
+    h->bounce = 0;
+    h->bounce_size = 0;
+    if(h->cancel_fd >= 0)
+        close(h->cancel_fd);
+    h->cancel_fd = -1;
     fd = h->desc;
     h->desc = -1;
     if(fd >= 0) {
         close(fd);
+        count_open(-1);
         DBG("[ usb closed %d ]\n", fd);
     }
 
     return 0;
 }
 
+int usb_enumerate(ifc_match_func callback, usb_ifc_info **list)
+{
+    struct ifc_list found;
+    int r;
+
+    memset(&found, 0, sizeof(found));
+
+    /* sysfs isn't always mounted (chroots), scan the nodes then */
+    if(access(USB_SYSFS_ROOT, R_OK) == 0)
+        r = scan_sysfs(USB_SYSFS_ROOT, callback, &found);
+    else
+        r = scan_usbfs(USB_DEV_ROOT, callback, &found);
+
+    if(r < 0) {
+        free(found.items);
+        found.items = 0;
+        found.count = -1;
+    }
+    *list = found.items;
+    return found.count;
+}
+
+int usb_enumerate_port(const char *port, ifc_match_func callback,
+                       usb_ifc_info **list)
+{
+    struct ifc_list found;
+
+    memset(&found, 0, sizeof(found));
+    *list = 0;
+
+    /* a name like "1-2.3" and nothing that leaves the directory */
+    if(port[0] == 0 || port[0] == '.' || strchr(port, '/')) {
+        errno = EINVAL;
+        return -1;
+    }
+    sysfs_device(USB_SYSFS_ROOT, port, callback, &found);
+
+    *list = found.items;
+    return found.count;
+}
+
+usb_handle *usb_open_ifc(const usb_ifc_info *info)
+{
+    usb_handle *h;
+    int fd;
+
+    fd = open(info->device_path, O_RDWR);
+    if(fd < 0) return 0;
+
+    h = claim_usb_device(fd, info->device_path, info->ep_in, info->ep_out,
+                         info->ifc_number, info->max_packet, info->in_packet);
+    if(h)
+        snprintf(h->port, sizeof(h->port), "%s", info->port_path);
+    return h;
+}
+
 usb_handle *usb_open(ifc_match_func callback)
 {
-    return find_usb_device("/dev/bus/usb", callback);
+    usb_ifc_info *list;
+    usb_handle *usb = 0;
+    int n, i;
+
+    n = usb_enumerate(callback, &list);
+    for(i = 0; i < n && usb == 0; i++)
+        usb = usb_open_ifc(&list[i]);
+    free(list);
+
+    return usb;
+}
+
+/* Hotplug watcher: kernel uevents over netlink, or inotify on the usbfs
+ * device nodes where netlink isn't permitted (some containers).
+ */
+static int hotplug_fd = -1;
+static int hotplug_netlink;
+
+static int hotplug_netlink_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_KOBJECT_UEVENT);
+    if(fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;
+    addr.nl_groups = 1;     /* kernel events */
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void hotplug_watch_buses(int fd)
+{
+    char busname[64];
+    DIR *busdir;
+    struct dirent *de;
+
+    busdir = opendir(USB_DEV_ROOT);
+    if(busdir == 0) return;
+
+    while((de = readdir(busdir))) {
+        if(badname(de->d_name)) continue;
+        if(snprintf(busname, sizeof(busname), "%s/%s", USB_DEV_ROOT,
+                    de->d_name) >= (int) sizeof(busname)) continue;
+        /* udev fixes up permissions after creating the node */
+        inotify_add_watch(fd, busname, IN_CREATE | IN_ATTRIB);
+    }
+    closedir(busdir);
+}
+
+static int hotplug_inotify_open(void)
+{
+    int fd;
+
+    fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(fd < 0) return -1;
+
+    /* new buses show up as directories here */
+    if(inotify_add_watch(fd, USB_DEV_ROOT, IN_CREATE) < 0) {
+        close(fd);
+        return -1;
+    }
+    hotplug_watch_buses(fd);
+
+    return fd;
+}
+
+int usb_hotplug_start(void)
+{
+    if(hotplug_fd >= 0) return 0;
+
+    hotplug_fd = hotplug_netlink_open();
+    hotplug_netlink = (hotplug_fd >= 0);
+    if(hotplug_fd < 0)
+        hotplug_fd = hotplug_inotify_open();
+
+    DBG("[ hotplug via %s ]\n", hotplug_fd < 0 ? "polling" :
+        hotplug_netlink ? "netlink" : "inotify");
+    return hotplug_fd < 0 ? -1 : 0;
+}
+
+void usb_hotplug_stop(void)
+{
+    if(hotplug_fd >= 0)
+        close(hotplug_fd);
+    hotplug_fd = -1;
+}
+
+/* drain pending notifications, returns 1 if a usb device was added */
+static int hotplug_drain(void)
+{
+    char buf[4096];
+    char *p;
+    int added = 0;
+    int n;
+
+    while((n = read(hotplug_fd, buf, sizeof(buf) - 1)) > 0) {
+        if(!hotplug_netlink) {
+            /* a bus directory appeared, watch the devices on it too */
+            hotplug_watch_buses(hotplug_fd);
+            added = 1;
+            continue;
+        }
+
+        /* "ACTION@DEVPATH\0KEY=VALUE\0...", only care about usb adds */
+        buf[n] = 0;
+        if(strncmp(buf, "add@", 4) && strncmp(buf, "bind@", 5))
+            continue;
+        for(p = buf + strlen(buf) + 1; p < buf + n; p += strlen(p) + 1) {
+            if(!strcmp(p, "SUBSYSTEM=usb")) {
+                added = 1;
+                break;
+            }
+        }
+    }
+
+    return added;
+}
+
+int usb_hotplug_wait(int timeout_ms)
+{
+    struct pollfd pfd;
+    long long deadline = now_ms() + timeout_ms;
+    int left = timeout_ms;
+    int r;
+
+    if(hotplug_fd < 0) {
+        poll(NULL, 0, timeout_ms);
+        return 0;
+    }
+
+    pfd.fd = hotplug_fd;
+    pfd.events = POLLIN;
+    while(left > 0) {
+        r = poll(&pfd, 1, left);
+        if(r < 0 && errno != EINTR) {
+            /* notification is broken; behave as if there were none */
+            left = deadline - now_ms();
+            if(left > 0) poll(NULL, 0, left);
+            return 0;
+        }
+        if(r > 0 && hotplug_drain()) return 1;
+        left = deadline - now_ms();
+    }
+
+    return 0;
 }
@@ -49,6 +49,9 @@
   is expected in each subsequent call that is accessing the device.
 */
 struct usb_handle {
+    /// Transport interface, must stay first
+    transport     t;
+
     /// Handle to USB interface
     ADBAPIHANDLE  adb_interface;
     
@@ -60,24 +63,46 @@ struct usb_handle {
     
     /// Interface name
     char*         interface_name;
+
+    /// Set by usb_cancel, fails all later transfers
+    volatile LONG cancelled;
 };
 
 /// Class ID assigned to the device by androidusb.sys
 static const GUID usb_class_id = ANDROID_USB_CLASS_ID;
 
 
-/// Checks if interface (device) matches certain criteria
-int recognized_device(usb_handle* handle, ifc_match_func callback);
+/// Checks if interface (device) matches certain criteria, and if so
+/// optionally returns its description in match
+int recognized_device(usb_handle* handle, ifc_match_func callback,
+                      usb_ifc_info* match);
 
 /// Opens usb interface (device) by interface (device) name.
 usb_handle* do_usb_open(const wchar_t* interface_name);
 
+/// Transport calls of an opened handle
+static const transport_ops usb_ops;
+
 /// Writes data to the opened usb handle
 int usb_write(usb_handle* handle, const void* data, int len);
 
+/// Writes data produced by a fill callback to the opened usb handle
+int usb_write_fill(usb_handle* handle, usb_fill_func fill, void* cookie,
+                   int len);
+
+/// Sets number of queued writes (AdbWinApi writes synchronously)
+void usb_set_queue_depth(usb_handle* handle, int depth);
+
+
+/// Reports transfer settings of the opened usb handle
+int usb_get_xfer_info(usb_handle* handle, usb_xfer_info* info);
+
 /// Reads data using the opened usb handle
 int usb_read(usb_handle *handle, void* data, int len);
 
+/// Checks whether a transfer has to give up, setting errno if so
+static int xfer_expired(usb_handle* handle, DWORD deadline);
+
 /// Cleans up opened usb handle
 void usb_cleanup_handle(usb_handle* handle);
 
@@ -90,10 +115,13 @@ int usb_close(usb_handle* handle);
 
 usb_handle* do_usb_open(const wchar_t* interface_name) {
     // Allocate our handle
-    usb_handle* ret = (usb_handle*)malloc(sizeof(usb_handle));
+    usb_handle* ret = (usb_handle*)calloc(1, sizeof(usb_handle));
     if (NULL == ret)
         return NULL;
 
+    ret->t.ops = &usb_ops;
+    ret->t.max_xfer = MAX_USBFS_BULK_SIZE;
+
     // Create interface.
     ret->adb_interface = AdbCreateInterfaceByName(interface_name);
 
@@ -151,19 +179,36 @@ usb_handle* do_usb_open(const wchar_t* interface_name) {
     return NULL;
 }
 
-int usb_write(usb_handle* handle, const void* data, int len) {
+static int xfer_expired(usb_handle* handle, DWORD deadline) {
+    if (handle->cancelled) {
+        errno = ECANCELED;
+        return 1;
+    }
+    // deadline 0 means wait forever, compare as a difference for wraparound
+    if (deadline && (LONG)(GetTickCount() - deadline) >= 0) {
+        errno = ETIMEDOUT;
+        return 1;
+    }
+    return 0;
+}
+
+int usb_write_timeout(usb_handle* handle, const void* data, int len,
+                      int timeout_ms, int* done) {
     unsigned long time_out = 500 + len * 8;
     unsigned long written = 0;
+    DWORD deadline = timeout_ms > 0 ? GetTickCount() + timeout_ms : 0;
     unsigned count = 0;
     int ret;
 
     DBG("usb_write %d\n", len);
+    if (done) *done = 0;
     if (NULL != handle) {
         // Perform write
         while(len > 0) {
             int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
-            int i = 0;
             do {
+                if (xfer_expired(handle, deadline))
+                    return -1;
                 ret = AdbWriteEndpointSync(handle->adb_write_pipe,
                                        (void*)data,
                                        (unsigned long)xfer,
@@ -183,6 +228,7 @@ int usb_write(usb_handle* handle, const void* data, int len) {
             count += written;
             len -= written;
             data += written;
+            if (done) *done = count;
 
             if (len == 0)
                 return count;
@@ -197,14 +243,81 @@ int usb_write(usb_handle* handle, const void* data, int len) {
     return -1;
 }
 
-int usb_read(usb_handle *handle, void* data, int len) {
+int usb_write(usb_handle* handle, const void* data, int len) {
+    return usb_write_timeout(handle, data, len, 0, NULL);
+}
+
+int usb_write_fill_timeout(usb_handle* handle, usb_fill_func fill,
+                           void* cookie, int len, int timeout_ms, int* done) {
+    DWORD start = GetTickCount();
+    unsigned count = 0;
+    char* buf;
+
+    if (done) *done = 0;
+    if (0 == len)
+        return usb_write_timeout(handle, NULL, 0, timeout_ms, NULL);
+
+    buf = (char*)malloc(MAX_USBFS_BULK_SIZE);
+    if (NULL == buf)
+        return -1;
+
+    // AdbWinApi has no mapped buffers, so fill a bounce buffer instead
+    while (len > 0) {
+        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
+        int left = 0;
+
+        // the whole fill shares one deadline
+        if (timeout_ms > 0) {
+            left = timeout_ms - (int)(GetTickCount() - start);
+            if (left <= 0) {
+                free(buf);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        if (fill(cookie, buf, xfer) != xfer ||
+            usb_write_timeout(handle, buf, xfer, left, NULL) != xfer) {
+            free(buf);
+            return -1;
+        }
+
+        count += xfer;
+        len -= xfer;
+        if (done) *done = count;
+    }
+
+    free(buf);
+    return count;
+}
+
+int usb_write_fill(usb_handle* handle, usb_fill_func fill, void* cookie,
+                   int len) {
+    return usb_write_fill_timeout(handle, fill, cookie, len, 0, NULL);
+}
+
+void usb_set_queue_depth(usb_handle* handle, int depth) {
+    // AdbWriteEndpointSync already uses 1MB transfers, nothing to queue
+}
+
+int usb_get_xfer_info(usb_handle* handle, usb_xfer_info* info) {
+    memset(info, 0, sizeof(*info));
+    info->xfer_size = MAX_USBFS_BULK_SIZE;
+    info->queue_depth = 1;
+    return 0;
+}
+
+int usb_read_timeout(usb_handle *handle, void* data, int len,
+                     int timeout_ms, int* done) {
     unsigned long time_out = 500 + len * 8;
     unsigned long read = 0;
+    DWORD deadline = timeout_ms > 0 ? GetTickCount() + timeout_ms : 0;
     int ret;
 
     DBG("usb_read %d\n", len);
+    if (done) *done = 0;
     if (NULL != handle) {
-        while (1) {
+        while (!xfer_expired(handle, deadline)) {
             int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
 
             ret = AdbReadEndpointSync(handle->adb_read_pipe,
@@ -215,6 +328,7 @@ int usb_read(usb_handle *handle, void* data, int len) {
             errno = GetLastError();
             DBG("usb_read got: %ld, expected: %d, errno: %d\n", read, xfer, errno);
             if (ret) {
+                if (done) *done = read;
                 return read;
             } else if (errno != ERROR_SEM_TIMEOUT) {
                 // assume ERROR_INVALID_HANDLE indicates we are disconnected
@@ -234,6 +348,60 @@ int usb_read(usb_handle *handle, void* data, int len) {
     return -1;
 }
 
+int usb_read(usb_handle *handle, void* data, int len) {
+    return usb_read_timeout(handle, data, len, 0, NULL);
+}
+
+void usb_cancel(usb_handle* handle) {
+    if (NULL != handle)
+        InterlockedExchange(&handle->cancelled, 1);
+}
+
+static int usb_t_read(transport* t, void* data, int len,
+                      int timeout_ms, int* done) {
+    return usb_read_timeout((usb_handle*)t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write(transport* t, const void* data, int len,
+                       int timeout_ms, int* done) {
+    return usb_write_timeout((usb_handle*)t, data, len, timeout_ms, done);
+}
+
+static int usb_t_write_fill(transport* t, transport_fill_func fill,
+                            void* cookie, int len, int timeout_ms, int* done) {
+    return usb_write_fill_timeout((usb_handle*)t, fill, cookie, len,
+                                  timeout_ms, done);
+}
+
+static int usb_t_close(transport* t) {
+    return usb_close((usb_handle*)t);
+}
+
+static void usb_t_cancel(transport* t) {
+    usb_cancel((usb_handle*)t);
+}
+
+static const transport_ops usb_ops = {
+    "AdbWinApi",
+    usb_t_read,
+    usb_t_write,
+    usb_t_write_fill,
+    NULL,           // AdbWinApi ends short writes itself
+    NULL,           // no write_next, one write per piece
+    usb_t_close,
+    usb_t_cancel,
+    NULL,           // AdbWinApi can't clear halts or reset
+};
+
+int usb_recover(usb_handle* handle, int hard) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+transport* usb_transport(usb_handle* handle) {
+    return &handle->t;
+}
+
 void usb_cleanup_handle(usb_handle* handle) {
     if (NULL != handle) {
         if (NULL != handle->interface_name)
@@ -273,7 +441,8 @@ int usb_close(usb_handle* handle) {
     return 0;
 }
 
-int recognized_device(usb_handle* handle, ifc_match_func callback) {
+int recognized_device(usb_handle* handle, ifc_match_func callback,
+                      usb_ifc_info* match) {
     struct usb_ifc_info info;
     USB_DEVICE_DESCRIPTOR device_desc;
     USB_INTERFACE_DESCRIPTOR interf_desc;
@@ -298,6 +467,7 @@ int recognized_device(usb_handle* handle, ifc_match_func callback) {
         return 0;
     }
 
+    memset(&info, 0, sizeof(info));
     info.dev_vendor = device_desc.idVendor;
     info.dev_product = device_desc.idProduct;
     info.dev_class = device_desc.bDeviceClass;
@@ -316,6 +486,8 @@ int recognized_device(usb_handle* handle, ifc_match_func callback) {
     }
 
     if (callback(&info) == 0) {
+        if (NULL != match)
+            *match = info;
         return 1;
     }
 
@@ -352,7 +524,7 @@ static usb_handle *find_usb_device(ifc_match_func callback) {
         handle = do_usb_open(next_interface->device_name);
         if (NULL != handle) {
             // Lets see if this interface (device) belongs to us
-            if (recognized_device(handle, callback)) {
+            if (recognized_device(handle, callback, NULL)) {
                 // found it!
                 break;
             } else {
@@ -374,6 +546,95 @@ usb_handle *usb_open(ifc_match_func callback)
     return find_usb_device(callback);
 }
 
+int usb_enumerate(ifc_match_func callback, usb_ifc_info **list)
+{
+    usb_handle* handle;
+    usb_ifc_info info;
+    usb_ifc_info* found = NULL;
+    usb_ifc_info* grown;
+    int count = 0;
+    char entry_buffer[2048];
+    AdbInterfaceInfo* next_interface = (AdbInterfaceInfo*)(&entry_buffer[0]);
+    unsigned long entry_buffer_size = sizeof(entry_buffer);
+    const wchar_t* wchar_name;
+    char* copy_name;
+
+    ADBAPIHANDLE enum_handle =
+        AdbEnumInterfaces(usb_class_id, true, true, true);
+
+    *list = NULL;
+    if (NULL == enum_handle)
+        return -1;
+
+    while (AdbNextInterface(enum_handle, next_interface, &entry_buffer_size)) {
+        entry_buffer_size = sizeof(entry_buffer);
+
+        handle = do_usb_open(next_interface->device_name);
+        if (NULL == handle)
+            continue;
+
+        if (recognized_device(handle, callback, &info)) {
+            // same wchar_t to char hack as find_usb_device
+            wchar_name = next_interface->device_name;
+            copy_name = info.device_path;
+            while (L'\0' != *wchar_name &&
+                   copy_name < info.device_path + sizeof(info.device_path) - 1)
+                *copy_name++ = (char)(*wchar_name++);
+            *copy_name = '\0';
+
+            grown = (usb_ifc_info*)realloc(found, (count + 1) * sizeof(info));
+            if (NULL != grown) {
+                found = grown;
+                found[count++] = info;
+            }
+        }
+
+        usb_cleanup_handle(handle);
+        free(handle);
+    }
+
+    AdbCloseHandle(enum_handle);
+    *list = found;
+    return count;
+}
+
+usb_handle *usb_open_ifc(const usb_ifc_info *info)
+{
+    wchar_t name[sizeof(info->device_path)];
+    int i;
+
+    for (i = 0; info->device_path[i]; i++)
+        name[i] = (wchar_t)info->device_path[i];
+    name[i] = L'\0';
+
+    return do_usb_open(name);
+}
+
+// AdbWinApi doesn't tell where a device is plugged in, port_path stays
+// empty and there is nothing to look up
+int usb_enumerate_port(const char *port, ifc_match_func callback,
+                       usb_ifc_info **list)
+{
+    *list = NULL;
+    return 0;
+}
+
+// no device notification here, open_device falls back to polling
+int usb_hotplug_start(void)
+{
+    return -1;
+}
+
+int usb_hotplug_wait(int timeout_ms)
+{
+    Sleep(timeout_ms);
+    return 0;
+}
+
+void usb_hotplug_stop(void)
+{
+}
+
 // called from fastboot.c
 void sleep(int seconds)
 {